@@ -104,8 +104,7 @@ void processCommandLine()
     // these used to store arguments between this function calls
     static bool retain = false;
     static int msg_len = 0;
-    static String topic;
-    static String msg;
+    static char topic[128]; // no String here: nothing is allocated after setup
 
     // check for hext argument or a new command
     // because some ccommands have optional arguments,
@@ -145,9 +144,12 @@ void processCommandLine()
                 break;
 
             if ( hc.get_parameter_index() == 0 )
-                topic = hc.get_str();
+                strncpy( topic, hc.get_str(), sizeof(topic) - 1 );
             else if ( hc.get_parameter_index() == 1 )
-                msg = hc.get_str();
+            {
+                msg_len = min( hc.get_length(), tmp_buf_size );
+                memcpy( tmp_buf, hc.get_str(), msg_len );
+            }
             else if ( hc.get_parameter_index() == 2 )
                 retain = hc.get_bool();
 
@@ -155,7 +157,7 @@ void processCommandLine()
             // hc.no_more_parameters() will ensure that unless the string is complete with EOL, we still miss some arguments
             if ( hc.is_command_complete() )
             {
-                mqttPublish( topic.c_str(), (void*)msg.c_str(), msg.length(), retain );
+                mqttPublish( topic, (void*)tmp_buf, msg_len, retain );
 
                 retain = false;
             }
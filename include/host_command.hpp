@@ -14,7 +14,10 @@
  * The repo is in: github.com/kadavris
 */
 
-#if defined(HOST_CMD_TEST)
+#if defined(HOST_CMD_BENCH)
+#include "../tests/bench_Stream.hpp"
+
+#elif defined(HOST_CMD_TEST)
 #include "../tests/test_Stream.hpp"
 
 #else
@@ -26,12 +29,109 @@
 
 #include <stdint.h>
 #include <limits.h>
+#include <string.h>
 #include <vector>
 
+class host_command;
+
+// parameter's info, see host_command::get_parameter_info(). bytes 0,1 are the max length
+// param types (byte 2):
+const uint32_t hcmd_t_bool  = 0x00010000;
+const uint32_t hcmd_t_byte  = 0x00020000;
+const uint32_t hcmd_t_int   = 0x00040000;
+const uint32_t hcmd_t_float = 0x00080000;
+const uint32_t hcmd_t_str   = 0x00100000; //< \S+
+const uint32_t hcmd_t_qstr  = 0x00200000; //< quoted string
+const uint32_t hcmd_t_blob  = 0x00400000; //< binary data. see encoding flags below
+
+// param flags: 4th byte
+const uint32_t hcmd_f_stream = 0x01000000; //< data is passed to the sink in chunks instead of being kept in buffer
+const uint32_t hcmd_f_hex    = 0x02000000; //< blob is hex-encoded
+const uint32_t hcmd_f_base64 = 0x04000000; //< blob is base64-encoded
+const uint32_t hcmd_f_netstring = 0x08000000; //< blob is raw bytes, prefixed by length: #length:data
+
+// wire protocols for host_command::set_framing()
+const uint8_t hc_framing_text = 0; //< default: text lines
+const uint8_t hc_framing_slip = 1; //< binary frames, delimited SLIP-style (RFC 1055)
+const uint8_t hc_framing_cobs = 2; //< binary frames, COBS-encoded and delimited by zero byte
+
+// text lines checksum for host_command::set_checksum()
+const uint8_t hc_checksum_none  = 0; //< default: no checksum
+const uint8_t hc_checksum_xor   = 1; //< NMEA-style: XOR of all chars, *hh
+const uint8_t hc_checksum_crc16 = 2; //< CRC-16/CCITT (0x1021, init 0xFFFF), *hhhh
+
+// latency histograms for host_command::set_histograms(). the time is counted from the command's first byte
+const uint8_t hc_latency_name   = 0; //< till the command is reported by get_next_command()
+const uint8_t hc_latency_params = 1; //< till all its parameters are reported
+const uint8_t hc_latency_done   = 2; //< till the next command is requested, i.e. the handler is done
+const int hc_latency_phases  = 3;
+const int hc_latency_buckets = 24; //< bucket 0: 0 ticks, bucket N: 2^(N-1) to 2^N-1 ticks, the last one: all the longer
+
+// events of the trace ring for host_command::set_trace(). every one has the time, command's ID and parameter's index
+const uint8_t hc_trace_start   = 1; //< got the first byte of command. arg: the byte
+const uint8_t hc_trace_command = 2; //< command is reported
+const uint8_t hc_trace_param   = 3; //< parameter is reported
+const uint8_t hc_trace_error   = 4; //< arg: error code
+const uint8_t hc_trace_reset   = 5; //< ready for the next command. arg: 1 if the rest of invalid input is skipped first
+const uint8_t hc_trace_timeout = 6; //< processing time is out. see limit_time()
+const int hc_trace_header = 12; //< trace storage: "HCT1", capacity, next event's index, number of events: 16-bit LE each
+const int hc_trace_event  = 8;  //< event: time (low 32 bits of clock, LE), kind, command's ID, parameter's index, arg
+
+/* Receiver of streamed parameters' data: (caller, data, data length, true if this is the last chunk) */
+typedef void (*host_command_sink)(host_command*, const uint8_t*, int, bool);
+
+/* Receiver of the double-buffered bulk read buffers: (caller, buffer, data length, true if this is the last one) */
+typedef void (*host_command_consumer)(host_command*, uint8_t*, int, bool);
+
+/* Flow control hook: (caller, true to stop the sender, false to let it go on). E.g. to drive the RTS line */
+typedef void (*host_command_flow)(host_command*, bool);
+
+/* Clock source for timeouts: returns ticks, wrapping around at ULONG_MAX. E.g. micros() or millis() */
+typedef unsigned long (*host_command_clock)(void);
+
+typedef struct //< internal: wrap-safe deadline
+{
+    unsigned long start; //< clock reading when it was set
+    unsigned long span;  //< ticks till the deadline. 0 - none
+} host_command_deadline;
+
+#if defined(HOST_CMD_STATS)
+const int hc_errors_count = 18; //< number of error codes. 0 is "no error"
+
+typedef struct //< input processing counters. see host_command::get_stats()
+{
+    unsigned long bytes;     //< input bytes scanned by the parser
+    unsigned long commands;  //< commands reported by get_next_command()
+    unsigned long params;    //< parameters reported by has_next_parameter()
+    unsigned long invalid;   //< invalid lines or frames skipped
+    unsigned long overflows; //< lines or frames discarded because they did not fit into the buffer
+    unsigned long timeouts;  //< processing or bulk read stopped by the time limit
+    unsigned long depth_max; //< the most bytes waiting in the source, seen by get_next_command() or has_next_parameter()
+    unsigned long flow_stops; //< times the sender was asked to stop. see set_flow_control()
+    unsigned long errors[ hc_errors_count ]; //< number of errors by their code
+} host_command_stats;
+#endif
+
+typedef struct //< internal: token bucket of the rate limit
+{
+    unsigned long interval; //< clock ticks per token. 0 - no limit
+    unsigned long last;     //< clock reading when the tokens were added last time
+    uint16_t burst;         //< max tokens
+    uint16_t tokens;        //< tokens available
+    unsigned long rejected; //< commands rejected
+} host_command_bucket;
+
 typedef struct //< internal: command's definition
 {
     const char* name;         //< command's name
     int optional_start;  //< start of optional parameters
+    int coalesce_key;    //< index of parameter telling apart the commands superseding each other in backlog. -1 - any, -2 - never
+    uint8_t priority;    //< commands of higher priority are reported from backlog first. 0 by default
+    bool data_follows;   //< its line is followed by raw data for fill_buffer() or begin_receive(). backlog does not read past it
+    host_command_bucket rate; //< rate limit of this command
+#if defined(HOST_CMD_STATS)
+    unsigned long reported; //< number of times the command was reported by get_next_command()
+#endif
     std::vector<uint32_t> params;   //< array of param types and flags
 } host_command_element;
 
@@ -52,9 +152,24 @@ public:
 
     // setup methods
     void allow_escape(bool); //< Enables or disables use of escape character '\'
+    void set_separator(char); //< set the char separating several commands on the same line. ';' by default, '\0' - none
+    void allow_sequence(bool); //< Enables or disables @number tag at the line start. tagged commands are ACK'ed or NAK'ed back
     void limit_time(int); //< sets maximum time for internal processes in milliseconds. Use to prevent timely blocks on long inputs.
+    void limit_work(int, long); //< bytes, microseconds. input processed by a single call of get_next_command() or has_next_parameter()
+    void set_clock(host_command_clock, unsigned long); //< clock, its ticks per millisecond. micros() by default
+    void limit_rate(int, long); //< number of commands, milliseconds. no more commands of any kind are reported for this period. <= 0 - no limit
+    void set_flow_control(int, int, host_command_flow = nullptr); //< high and low watermarks of the source's backlog, hook. XON/XOFF if no hook
     void set_interactive(bool, const char*); //< if true then we'll produce some answer/error messages to host:
+    void set_sink(host_command_sink); //< set the receiver of streamed parameters' data
+    void set_batch_buffer(uint8_t*, long); //< storage, its size. enable BEGIN/COMMIT/ABORT batches of commands
+    bool set_line_cache(uint8_t*, long, uint8_t); //< storage, its size, number of slots. enable the cache of recently parsed lines
+    bool set_backlog(uint8_t*, long); //< storage, its size. enable reading of available lines ahead into the backlog of commands
+    bool set_histograms(uint32_t*, long); //< storage, its length in counters. enable per command latency histograms. see hc_latency_*
+    bool set_trace(uint8_t*, long); //< storage, its size. enable the ring of recent parser events. see hc_trace_*
+    void set_framing(uint8_t); //< switch between text (default) and binary frames wire protocol. see hc_framing_*
+    void set_checksum(uint8_t, uint8_t* = nullptr, long = 0); //< require text lines to end with checksum. see hc_checksum_*. storage, its size to hold the command until verified
 
+    bool share_commands(const host_command&); //< use the other instance's commands instead of defining own ones. return false if there are some already
     int new_command(const char*, const char*); //< command name, printf-style params: return -1 on error
 
     bool new_command(const char*); //< start to define the new command. Use this for relaxed, step by step definitions
@@ -64,7 +179,15 @@ public:
     void add_float_param(); //< Adds another, floating point number parameter for the current command
     void add_str_param(uint16_t); //< Adds another, const char* w/o spaces parameter for the current command
     void add_qstr_param(uint16_t); //< Adds another, quoted const char* parameter for the current command
+    void add_hex_param(uint16_t); //< Adds another, hex-encoded binary parameter for the current command
+    void add_base64_param(uint16_t); //< Adds another, base64-encoded binary parameter for the current command
+    void add_netstring_param(uint16_t); //< Adds another, length-prefixed raw data parameter for the current command
+    void set_streamed(); //< Indicate that the last added parameter's data should be passed to the sink in chunks
     void optional_from_here(); //< Indicate that the next added parameters will be treated as optional
+    void coalesce_by(int); //< key parameter's index or -1. the newer command in backlog supersedes the older one with the same key
+    void set_priority(uint8_t); //< commands of higher priority are reported from backlog before the others. 0 by default
+    void set_data_follows(); //< the command's line is followed by raw data, so backlog does not read ahead past it
+    void set_rate_limit(int, long); //< number of commands, milliseconds. no more of this command are reported for this period. <= 0 - no limit
 
     // processing methods
     bool     get_next_command(); //< Request to get next command from the input. return false if there is no data yet or error
@@ -72,6 +195,18 @@ public:
     const char*   get_command_name(); //< return current command's name. "" if none
     bool     is_command_complete() const; //< return true if current command's processing is done nicely or with error.
     bool     is_invalid_input() const; //< return true if erroneous input detected
+    bool     is_batch_open() const; //< return true if commands are being collected into batch
+    bool     is_input_paused() const; //< return true if the sender was asked to stop by flow control
+    unsigned long get_rejected(int) const; //< command's ID or -1 for all. return number of commands rejected by rate limits
+    unsigned long get_cache_hits() const; //< return number of lines found in the line cache
+    unsigned long get_cache_misses() const; //< return number of lines parsed as usual with the line cache on
+    const uint32_t* get_histogram(int, uint8_t) const; //< command's ID, hc_latency_* phase. return hc_latency_buckets counters or nullptr
+    void     dump_trace(Stream*); //< print the trace ring's events as hex lines, the oldest first. see tools/hc_trace.py
+#if defined(HOST_CMD_STATS)
+    host_command_stats get_stats() const; //< return the snapshot of input processing counters
+    unsigned long get_command_stats(int) const; //< command's ID. return number of times it was reported. 0 if no such command
+    void     reset_stats(); //< zero all the counters
+#endif
 
     bool     has_next_parameter(); //< return true if we have the data of the next parameter
     int      get_parameter_index(); //< return current parameter's ID. -1 if none
@@ -84,26 +219,197 @@ public:
     int      get_int() const; //< return integer number representation of current parameter's input data
     float    get_float() const; //< return floating point number representation of current parameter's input data
     const char* get_str(); //< return const char* representation of current parameter's input data. Actually - ptr to internal buffer.
+    const uint8_t* get_blob() const; //< return decoded binary data of current parameter. Actually - ptr to internal buffer.
+    int      get_length() const; //< return length of current parameter's data in bytes
 
     void     discard(); //< discard current command's processing completely
 
+    long     compile(Stream*, uint8_t*, long); //< text source, destination, its size. parse commands into compact records. return length or -1
+    bool     replay(const uint8_t*, long); //< records, their length. report stored commands as if they have arrived
+
     bool     fill_buffer(char *, int); //< buf ptr, buf length. bulk read data from source into user-supplied buffer.
+    bool     begin_receive(char *, int, long timeout = -1); //< buf ptr, buf length, timeout in ms. start non-blocking bulk read
+    bool     begin_receive(char *, char *, int, long, host_command_consumer, long timeout = -1); //< buf1, buf2, bufs length, total, consumer, timeout. start double-buffered bulk read
+    void     release_buffer(); //< tell that consumer is done with the oldest buffer handed to it
+    int      poll_receive(); //< move available data into bulk read buffer. return 1 if done, 0 if in progress, -1 on error/timeout
+    long     get_received() const; //< return number of bytes received by bulk read
 
 private:
     uint8_t* buf;        //< internal: temporary buffer
     int buf_len;         //< internal: length of the buffer needed
     int buf_pos;         //< internal: pos into buffer where a new char will be stored
     std::vector<host_command_element*> commands; //< array of definitions
+    bool shared_commands; //< the definitions belong to the other instance. see share_commands()
     int cur_cmd;    //< index into commands or -1 - incomplete or -2 - not in list
     int cur_param;  //< index of the current param available. -1 if none
     int err_code;        //< last error code (host_command_error_codes)
     uint32_t flags;      //< behavior changing settings. see host_cmd_flag_*
     int max_time;        //< max time for internal processes in milliseconds. no timeout if <= 0
+    int work_bytes;      //< max input bytes processed per call. no limit if <= 0
+    long work_us;        //< max time spent on input per call in microseconds. no limit if <= 0
+    int work_left;       //< internal: bytes left in the current call's budget. 0 if it is spent
+    uint8_t work_count;  //< internal: bytes processed since the last clock reading
+    host_command_deadline work_deadline; //< internal: end of the current call's time budget
+    host_command_clock clock_src; //< clock for all the timeouts
+    unsigned long clock_per_ms; //< clock ticks per millisecond
     uint32_t state;      //< internal: state flags (bitfield actually)
+    host_command_sink sink; //< receiver of the streamed parameters' data
+    int streamed_len;    //< internal: amount of the current parameter's data already passed to the sink
+    uint16_t dec_acc;    //< internal: hex/base64 decoder's bits accumulator
+    uint8_t dec_bits;    //< internal: number of bits pending in dec_acc
+    long payload_left;   //< internal: bytes of length-prefixed data left to read
+    const uint8_t* frame; //< internal: binary frame or stored record being processed
+    int frame_len;       //< internal: binary frame length
+    int frame_pos;       //< internal: offset of the next field in binary frame
+    const uint8_t* field; //< internal: current parameter's data in binary frame
+    int field_len;       //< internal: current parameter's data length in binary frame
+    uint8_t cobs_code;   //< internal: last COBS code byte
+    uint8_t cobs_left;   //< internal: bytes left in current COBS block
+    char* bulk_dst;      //< internal: bulk read destination. nullptr if none in progress
+    int bulk_len;        //< internal: bulk read buffer length
+    int bulk_pos;        //< internal: bulk read bytes in the current buffer
+    char* bulk_bufs[2];  //< internal: bulk read buffers. the same one twice if not double-buffered
+    uint8_t bulk_fill;   //< internal: index of buffer being filled
+    uint8_t bulk_busy;   //< internal: number of buffers handed over to consumer and not released yet
+    long bulk_total;     //< internal: bulk read total length requested
+    long bulk_received;  //< internal: bulk read bytes received so far
+    host_command_consumer consumer; //< internal: receiver of double-buffered bulk read data
+    host_command_deadline bulk_deadline; //< internal: bulk read timeout
+    char separator;      //< commands separator on the same line. '\0' if none
+    long seq;            //< internal: sequence number of the current line. -1 if none
+    uint8_t* rec_buf;    //< internal: storage for the batch records. nullptr if batches are off
+    long rec_size;       //< internal: batch storage size
+    long rec_used;       //< internal: batch storage bytes used
+    long rec_start;      //< internal: offset of the record being captured. -1 if none
+    uint8_t* hold_buf;   //< internal: storage for the command held until its checksum is verified. nullptr if none
+    long hold_size;      //< internal: its size
+    long hold_used;      //< internal: its bytes used
+    long hold_start;     //< internal: offset of the held record being captured. -1 if none
+    const uint8_t* play_ptr; //< internal: next record to be reported
+    long play_left;      //< internal: bytes of records left to be reported
+    bool played;         //< internal: the current command is a played record. its rate is not checked
+    bool batch_open;     //< internal: got BEGIN. collecting commands
+    int batch_err;       //< internal: first error in the batch being collected
+    uint8_t* cache;      //< internal: line cache storage: line buffer and then slots. nullptr if off
+    int cache_slot_size; //< internal: line cache slot size
+    uint8_t cache_slots; //< internal: number of line cache slots
+    uint8_t cache_next;  //< internal: slot to be replaced next
+    int cache_fill;      //< internal: slot being filled with the command of the line just parsed. -1 if none
+    int fill_pos;        //< internal: bytes of record in the slot being filled
+    uint16_t fill_line_len; //< internal: length of the line for the slot being filled
+    uint32_t line_hash;  //< internal: hash of the line for the slot being filled
+    int line_len;        //< internal: length of the line being read into line cache's buffer
+    const uint8_t* in_ptr; //< internal: the rest of the line read into line cache's buffer
+    int in_left;         //< internal: bytes left in in_ptr
+    unsigned long cache_hits;   //< internal: lines found in the cache
+    unsigned long cache_misses; //< internal: lines not found in the cache
+    uint8_t* bl_line;    //< internal: backlog's line buffer. nullptr if backlog is off
+    uint8_t* backlog;    //< internal: backlog's records of commands read ahead
+    long bl_size;        //< internal: backlog's room for records
+    long bl_used;        //< internal: backlog's bytes used
+    long bl_start;       //< internal: offset of the record being captured into the backlog. -1 if none
+    long bl_taken;       //< internal: offset of the record reported last time. -1 if none
+    int bl_held;         //< internal: number of commands followed by raw data in backlog. no lines are read ahead while there are some
+    uint16_t line_sum;   //< internal: checksum of the current line's data so far
+    uint16_t sum_got;    //< internal: checksum value received
+    uint8_t sum_digits;  //< internal: number of checksum's digits received
+    uint32_t* hist;      //< internal: latency histograms storage. nullptr if off
+    int hist_cmds;       //< internal: number of commands having room for histograms
+    int hist_cmd;        //< internal: command being timed after it was reported. -1 if none
+    unsigned long hist_t0; //< internal: clock reading at the command's first byte
+    uint8_t hist_marks;  //< internal: bit 0 - hist_t0 is set, next ones - phases already counted
+    host_command_bucket rate; //< rate limit of all the commands
+    int flow_high;       //< bytes waiting in the source to stop the sender at. flow control is off if <= 0
+    int flow_low;        //< bytes waiting in the source to let the sender go on at
+    host_command_flow flow_hook; //< flow control hook. XON/XOFF is sent if nullptr
+    bool flow_stopped;   //< internal: the sender was asked to stop
+    uint8_t* trace_buf;  //< internal: trace ring storage. nullptr if off
+    uint16_t trace_cap;  //< internal: trace ring capacity in events
+#if defined(HOST_CMD_STATS)
+    host_command_stats stats; //< internal: input processing counters
+#endif
 
     void _init(size_t, Stream *); //< constructor helper
     void init_for_new_input(uint32_t); //< set new state. also reset data before new command processing.
+    void set_error(int); //< set the error code and count it
+    bool take_next_command(); //< get_next_command() itself
+    void hist_start(); //< remember the time of command's first byte if it is not yet
+    void hist_note(uint8_t); //< count the time since the command's first byte in phase's histogram
+    void trace(uint8_t, uint8_t); //< kind, arg. add the event to the trace ring
+    void start_work(); //< renew the per-call budget
+    void set_bucket(host_command_bucket&, int, long); //< count, milliseconds. set up the rate limit
+    void refill(host_command_bucket&); //< add the tokens for the time passed
+    bool take_batch_rate(); //< take the tokens for all the commands of the batch being committed. return false if over the limit
+    bool take_rate(); //< take the tokens for the current command. return false if it is over the limit
+    void check_flow(); //< check the source's backlog against watermarks and stop or resume the sender
+    void set_flow(bool); //< stop or resume the sender
+    int spend_work(int); //< take bytes from the per-call budget. return the number allowed, 0 if budget is spent
+    void set_deadline(host_command_deadline&, unsigned long); //< start counting ticks till the deadline. 0 - none
+    bool is_past(const host_command_deadline&) const; //< return true if the deadline is set and passed
+    unsigned long ms_to_ticks(long) const; //< convert milliseconds to clock ticks. 0 if <= 0
+    unsigned long us_to_ticks(long) const; //< convert microseconds to clock ticks. 0 if <= 0
     int check_input(); //< very internal. check source for data and do all incoming data processing.
     int find_command_index(const char *); //< return command's id/index by name. -1 if not found
+    bool start_bulk(int, long, long); //< reset bulk read state
+    int bulk_timeout(); //< end bulk read if it is out of time. return -1 if so, 0 if not
+    int read_frame(); //< get binary frame from source. return 1 if done, 0 if need more, -1 on error
+    int start_frame(); //< start processing of received binary frame
+    int open_frame(); //< start processing of binary frame or record: take the command index
+    int batch_marker(); //< process batch control word. return 1 if it is not the one
+    int capture(int); //< parse the rest of command into the batch record. return 1 if done, 0 if need more, -1 on error, -2 if no room
+    long put_field(uint8_t*, long); //< store current parameter as binary frame's field. return its length or -1
+    int next_record(); //< start processing of the next stored record
+    void take_record_seq(); //< take the sequence tag of the record being opened
+    static const uint8_t* record_body(const uint8_t*); //< return the stored record at its command's index
+    void settle_records(const uint8_t*, long, int); //< ACK or NAK the tagged records being dropped
+    int cache_lookup(); //< read the line and find it in the cache. return 1 on hit, 0 if need more, -1 on miss
+    void cache_put(bool); //< add the newly parsed data to the cache slot being filled
+    int read_line(uint8_t*); //< read the source into line buffer. return line's length if complete or too long, 0 if need more
+    int backlog_next(); //< read ahead and report the most urgent command from backlog. return 1 if reported, 0 if none, -1 if not now
+    void fill_backlog(); //< parse the available lines into the backlog
+    void swap_records(uint8_t*&, long&, long&, long&); //< exchange the batch records storage with the other one: storage, size, used, record's start
+    bool is_held() const; //< return true if the text command is to be held until its checksum is verified
+    void coalesce(long); //< drop the commands superseded by the record just added to backlog
+    void drop_record(long); //< remove the record from backlog
+    const uint8_t* record_field(const uint8_t*, int, long*) const; //< find the field of stored record. return nullptr if none
+    int input_available(); //< return number of bytes available from the cached line or source
+    int input_read(); //< read the byte from the cached line or source
+    int input_read_bytes(uint8_t*, int); //< read bytes from the cached line or source
+    int next_field(); //< get next parameter from binary frame
+    long field_int() const; //< return the number from binary frame field
+    float field_float() const; //< return the floating point number from binary frame field
+    void acknowledge(); //< send ACK/NAK for the sequence-tagged command
+    void reply(long, int); //< send ACK or NAK for the sequence number
+    int checksum_char(int); //< add next char to the line's checksum. return 1 if char is checksum's part, 0 if not, -1 on error
+    void sum_byte(uint8_t); //< add the byte to the line's checksum as is
+    void reset_checksum(); //< start the line's checksum anew
+    bool decode_char(int); //< decode next hex/base64 char into buffer. return false on error
+    bool prefix_char(int); //< process next char of length prefix. return false on error
+    int read_payload(int); //< copy length-prefixed data into buffer. return 1 if done, 0 if need more, -1 on error
+    int finish_parameter(); //< complete the current parameter. return 1 if OK, -1 on error
+    void flush_to_sink(bool); //< pass buffer's contents to the sink
+    bool is_unfinished() const; //< return true if the text command has some parameters yet to come
+    bool is_resumable(); //< return true if the command waits for the rest of its parameters and there is the input to go on
+
+    friend class host_command_mux;
+};
+
+/* Round-robin poller of several host_command instances, each having its own source. E.g. sharing the commands */
+class host_command_mux
+{
+public:
+    host_command_mux(host_command**, uint8_t, int); //< instances, their number, input bytes budget of each per call. <= 0 - no limit
+    host_command_mux(const host_command_mux&) = delete;
+
+    host_command* get_next_command(); //< poll the instances in turn. return the one having the command or nullptr if none has
+    int get_index() const; //< return the index of instance returned last time. -1 if none
+    bool is_continued() const; //< return true if the instance returned last time goes on with the same command's parameters
+
+private:
+    host_command** hcs;  //< instances
+    uint8_t count;       //< number of instances
+    uint8_t next;        //< internal: instance to be polled first next time
+    int last;            //< internal: index of instance returned last time. -1 if none
+    bool continued;      //< internal: the instance returned last time has the same command as before
 };
 
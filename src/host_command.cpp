@@ -12,15 +12,6 @@
 #define host_command_cpp
 #include "host_command.hpp"
 
-// bytes 0,1 of param definition is the max length
-// param types (byte 2):
-const uint32_t hcmd_t_bool  = 0x00010000;
-const uint32_t hcmd_t_byte  = 0x00020000;
-const uint32_t hcmd_t_int   = 0x00040000;
-const uint32_t hcmd_t_float = 0x00080000;
-const uint32_t hcmd_t_str   = 0x00100000; //< \S+
-const uint32_t hcmd_t_qstr  = 0x00200000; //< quoted string
-
 const char command_code_optional = '?';
 const char command_code_bool  = 'b';
 const char command_code_byte  = 'c';
@@ -28,12 +19,41 @@ const char command_code_int   = 'd';
 const char command_code_float = 'f';
 const char command_code_qstr  = 'q';
 const char command_code_str   = 's';
-
-// param flags: 4th byte
-//const uint32_t host_cmd_??? = 0x01000000;
+const char command_code_hex   = 'x';
+const char command_code_base64 = 'm';
+const char command_code_netstring = 'n';
+const char command_code_stream = '>';
+const char sequence_tag = '@';
+const char* const batch_begin  = "BEGIN";  //< start collecting commands into batch
+const char* const batch_commit = "COMMIT"; //< run the collected commands
+const char* const batch_abort  = "ABORT";  //< drop the collected commands
+const int cache_slot_header = 6; //< line cache slot: 4 bytes of line's hash, 2 bytes of its length, then the line and the record
+const long sequence_max = 999999999L; //< 9 digits max
+const uint8_t record_seq = 0xFF; //< stored record of tagged command starts with it and 4 bytes of the tag, then command's index
+const int record_seq_size = 5; //< the tag's prefix size
+const int commands_max = 255; //< frames and records keep the command's index in a byte. 0xFF is taken by record_seq
+const int no_coalescing = -2; //< host_command_element::coalesce_key: commands never supersede each other
+const uint8_t work_clock_every = 16; //< input bytes between the clock readings
+const char trace_magic[4] = { 'H', 'C', 'T', '1' }; //< trace storage's signature
+const uint8_t flow_xon  = 0x11; //< DC1: the sender may go on
+const uint8_t flow_xoff = 0x13; //< DC3: the sender should stop
 
 const uint32_t hc_flag_interactive = 0x00000001; //< report problems back to host
 const uint32_t hc_flag_escapes     = 0x00000002; //< allow escape char '\' to be used
+const uint32_t hc_flag_slip        = 0x00000004; //< binary frames, SLIP-delimited
+const uint32_t hc_flag_cobs        = 0x00000008; //< binary frames, COBS-encoded
+constexpr uint32_t hc_flag_framing = hc_flag_slip | hc_flag_cobs; //< any binary framing is on
+const uint32_t hc_flag_xor         = 0x00000010; //< text lines end with NMEA-style *hh XOR checksum
+const uint32_t hc_flag_crc16       = 0x00000020; //< text lines end with *hhhh CRC-16/CCITT checksum
+constexpr uint32_t hc_flag_checksum = hc_flag_xor | hc_flag_crc16; //< any line checksum is on
+const uint32_t hc_flag_sequence    = 0x00000040; //< lines may start with @number tag. ACK/NAK is sent back for those
+const uint32_t hc_flag_batches     = 0x00000080; //< BEGIN/COMMIT/ABORT words are recognized
+
+// SLIP special bytes (RFC 1055)
+const uint8_t slip_end     = 0xC0;
+const uint8_t slip_esc     = 0xDB;
+const uint8_t slip_esc_end = 0xDC;
+const uint8_t slip_esc_esc = 0xDD;
 
 // bitflags used for internal state tracking
 const uint32_t hc_state_clean          = 0; //< nothing yet happened
@@ -45,6 +65,14 @@ const uint32_t hc_state_d_quote        = 0x00000010; //< got " - quoted string.
 const uint32_t hc_state_s_quote        = 0x00000020; //< got ' - quoted string. used for sanity checking
 const uint32_t hc_state_escape         = 0x00000040; //< got escape symbol 
 const uint32_t hc_state_skip           = 0x00000080; //< skip input till the next param (used if there are max length specified)
+const uint32_t hc_state_pad            = 0x00000100; //< got base64 padding char '='. only more padding allowed
+const uint32_t hc_state_count          = 0x00000200; //< got '#' of length-prefixed data. reading the length
+const uint32_t hc_state_payload        = 0x00000400; //< reading length-prefixed data as is
+const uint32_t hc_state_frame          = 0x00000800; //< command came in binary frame. parameters are taken from there
+const uint32_t hc_state_sum            = 0x00001000; //< got '*'. reading the line's checksum
+const uint32_t hc_state_tail           = 0x00002000; //< got all parameters. waiting for the checksum and EOL
+const uint32_t hc_state_seq            = 0x00004000; //< got '@' at the line start. reading the sequence number
+const uint32_t hc_state_delim          = 0x00008000; //< length-prefixed data is over. waiting for the delimiter or EOL
 const uint32_t hc_state_invalid        = 0x10000000; //< got invalid data. waiting for EOL
 constexpr uint32_t hc_state_got_some   = hc_state_cmd | hc_state_param; //< if we started to process cmd parts already
 constexpr uint32_t hc_state_got_quotes = hc_state_d_quote | hc_state_s_quote; //< got a 1st quote of quoted string. used for sanity checking
@@ -59,6 +87,16 @@ static const char* hc_errors[] =
     /* 5*/"invalid parameters specification for new_command(Source, SPEC)",
     /* 6*/"parameter length exceeded or user requested too small buffer",
     /* 7*/"expected quoted string but got no quote",
+    /* 8*/"invalid hex or base64 encoded data",
+    /* 9*/"timed out",
+    /*10*/"invalid length prefix of raw data",
+    /*11*/"malformed binary frame",
+    /*12*/"missing or wrong checksum",
+    /*13*/"unknown command",
+    /*14*/"batch has invalid commands or does not fit",
+    /*15*/"command rate limit exceeded",
+    /*16*/"commands are shared from another instance",
+    /*17*/"too many commands for one byte index",
 };
 
 const int hc_error_no_error = 0;
@@ -69,6 +107,146 @@ const int hc_error_required_missing = 4; //< missing argument was not marked as
 const int hc_error_invalid_param_spec = 5; //< invalid parameters specification for new_command(x,x)
 const int hc_error_param_too_long = 6; //< parameter length exceeded or user requested too small buffer
 const int hc_error_missing_quotes = 7; //< expected quoted string but got no quote
+const int hc_error_bad_encoding = 8; //< invalid hex or base64 encoded data
+const int hc_error_timeout = 9; //< time is out while waiting for data
+const int hc_error_bad_prefix = 10; //< invalid #length: prefix of length-prefixed data
+const int hc_error_bad_frame = 11; //< binary frame is broken or its fields do not match parameters definition
+const int hc_error_bad_checksum = 12; //< line's checksum is missing, malformed or does not match the data
+const int hc_error_unknown_command = 13; //< command name is not defined or missing
+const int hc_error_bad_batch = 14; //< some command of the batch was invalid or the batch storage is too small
+const int hc_error_rate_limited = 15; //< command came too soon after the previous ones. see limit_rate() and set_rate_limit()
+const int hc_error_shared_commands = 16; //< attempt to define the command in instance sharing the other one's commands
+const int hc_error_too_many_commands = 17; //< frames and stored records can't address the command. see commands_max
+
+#if defined(HOST_CMD_STATS)
+static_assert( sizeof(hc_errors) / sizeof(hc_errors[0]) == hc_errors_count, "hc_errors_count does not match the errors table" );
+#define hc_stat(_expr) (stats._expr) //< update the counter. compiled out if the stats are off
+#else
+#define hc_stat(_expr) ((void)0)
+#endif
+
+// CRC-16/CCITT (polynomial 0x1021) lookup table: one step per byte instead of per bit
+static const uint16_t hc_crc16_table[256] =
+{
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+// base64 decoding table: char -> 6 bit value or -1 if invalid. '-' and '_' are accepted for URL-safe variant
+static const int8_t hc_base64_values[256] =
+{
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, 62, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/**
+* @brief Return 4 bytes of little-endian data as a number
+*
+* @param p: data
+* @return uint32_t
+*/
+static uint32_t get_le32(const uint8_t* p)
+{
+    return p[0] | (static_cast<uint32_t>( p[1] ) << 8) | (static_cast<uint32_t>( p[2] ) << 16) | (static_cast<uint32_t>( p[3] ) << 24);
+}
+
+/**
+* @brief Store the number as 4 bytes of little-endian data
+*
+* @param p: destination
+* @param v: number
+*/
+static void put_le32(uint8_t* p, uint32_t v)
+{
+    p[0] = static_cast<uint8_t>( v );
+    p[1] = static_cast<uint8_t>( v >> 8 );
+    p[2] = static_cast<uint8_t>( v >> 16 );
+    p[3] = static_cast<uint8_t>( v >> 24 );
+}
+
+/**
+* @brief Find where the parameter's field of binary frame or stored record is
+*
+* @param param: parameter's definition
+* @param p: field's start
+* @param left: bytes left in the frame
+* @param data: receives the start of field's data
+* @param len: receives the length of field's data
+* @return int: bytes taken by the field, or -1 if it does not fit
+*/
+static int field_size(uint32_t param, const uint8_t* p, int left, const uint8_t** data, int* len)
+{
+    int size;
+
+    *data = p;
+
+    if ( param & (hcmd_t_bool | hcmd_t_byte) )
+        size = *len = 1;
+
+    else if ( param & (hcmd_t_int | hcmd_t_float) )
+        size = *len = 4;
+
+    else if ( param & (hcmd_t_str | hcmd_t_qstr) )
+    {
+        const uint8_t* end = static_cast<const uint8_t*>( memchr( p, 0, left ) );
+
+        *len = end == nullptr ? left : static_cast<int>( end - p );
+        size = *len + 1; // with terminating zero. will not fit if there is none
+    }
+
+    else // binary types
+    {
+        *len = left < 2 ? left : p[0] | (p[1] << 8);
+        *data = p + 2;
+        size = *len + 2;
+    }
+
+    return size > left ? -1 : size;
+}
 
 /**
 * @brief Simple, "equal or not" case-insensitive strings comparison
@@ -124,8 +302,71 @@ void host_command::_init(size_t _bs, Stream* s)
         buf_len = static_cast<int>( _bs );
 
     buf = new uint8_t[buf_len];
+    shared_commands = false;
+    state = hc_state_clean;
     flags = hc_flag_escapes;
     max_time = -1; // no limit
+    work_bytes = 0;
+    work_us = 0;
+    work_left = INT_MAX;
+    work_count = 0;
+    clock_src = micros;
+    clock_per_ms = 1000;
+    work_deadline.start = work_deadline.span = 0;
+    bulk_deadline.start = bulk_deadline.span = 0;
+    sink = nullptr;
+    field = buf;
+    field_len = frame_len = frame_pos = 0;
+    cobs_code = cobs_left = 0;
+    bulk_dst = nullptr;
+    bulk_len = bulk_pos = 0;
+    payload_left = 0;
+    bulk_total = bulk_received = 0;
+    bulk_busy = 0;
+    consumer = nullptr;
+    seq = -1;
+    separator = ';';
+    frame = buf;
+    rec_buf = nullptr;
+    rec_size = rec_used = 0;
+    rec_start = -1;
+    hold_buf = nullptr;
+    hold_size = hold_used = 0;
+    hold_start = -1;
+    play_ptr = nullptr;
+    play_left = 0;
+    played = false;
+    batch_open = false;
+    batch_err = 0;
+    cache = nullptr;
+    cache_slots = cache_next = 0;
+    cache_slot_size = 0;
+    cache_fill = -1;
+    fill_pos = line_len = 0;
+    fill_line_len = 0;
+    line_hash = 0;
+    in_ptr = nullptr;
+    in_left = 0;
+    cache_hits = cache_misses = 0;
+    bl_line = backlog = nullptr;
+    bl_size = bl_used = 0;
+    bl_start = bl_taken = -1;
+    bl_held = 0;
+    hist = nullptr;
+    hist_cmds = 0;
+    hist_cmd = -1;
+    hist_t0 = 0;
+    hist_marks = 0;
+    rate.interval = rate.last = rate.rejected = 0;
+    rate.burst = rate.tokens = 0;
+    flow_high = flow_low = 0;
+    flow_hook = nullptr;
+    flow_stopped = false;
+    trace_buf = nullptr;
+    trace_cap = 0;
+#if defined(HOST_CMD_STATS)
+    reset_stats();
+#endif
 
     init_for_new_input( hc_state_clean );
 }
@@ -165,15 +406,100 @@ host_command::host_command( host_command&& src ) noexcept
     src.buf_len = src.buf_pos = 0;
 
     commands = std::move(src.commands);
+    shared_commands = src.shared_commands;
     cur_cmd = src.cur_cmd;
     cur_param = src.cur_param;
     err_code = src.err_code;
     flags = src.flags;
     max_time = src.max_time;
+    work_bytes = src.work_bytes;
+    work_us = src.work_us;
+    work_left = src.work_left;
+    work_count = src.work_count;
+    work_deadline = src.work_deadline;
+    clock_src = src.clock_src;
+    clock_per_ms = src.clock_per_ms;
     prompt = src.prompt;
     src.prompt = nullptr;
     source = src.source;
     state = src.state;
+    sink = src.sink;
+    streamed_len = src.streamed_len;
+    dec_acc = src.dec_acc;
+    dec_bits = src.dec_bits;
+    payload_left = src.payload_left;
+    frame_len = src.frame_len;
+    frame_pos = src.frame_pos;
+    field = src.field;
+    field_len = src.field_len;
+    cobs_code = src.cobs_code;
+    cobs_left = src.cobs_left;
+    bulk_dst = src.bulk_dst;
+    bulk_len = src.bulk_len;
+    bulk_pos = src.bulk_pos;
+    bulk_deadline = src.bulk_deadline;
+    bulk_bufs[0] = src.bulk_bufs[0];
+    bulk_bufs[1] = src.bulk_bufs[1];
+    bulk_fill = src.bulk_fill;
+    bulk_busy = src.bulk_busy;
+    bulk_total = src.bulk_total;
+    bulk_received = src.bulk_received;
+    consumer = src.consumer;
+    src.bulk_dst = nullptr;
+    seq = src.seq;
+    separator = src.separator;
+    frame = src.frame;
+    rec_buf = src.rec_buf;
+    rec_size = src.rec_size;
+    rec_used = src.rec_used;
+    rec_start = src.rec_start;
+    hold_buf = src.hold_buf;
+    hold_size = src.hold_size;
+    hold_used = src.hold_used;
+    hold_start = src.hold_start;
+    play_ptr = src.play_ptr;
+    play_left = src.play_left;
+    played = src.played;
+    batch_open = src.batch_open;
+    batch_err = src.batch_err;
+    cache = src.cache;
+    cache_slots = src.cache_slots;
+    cache_slot_size = src.cache_slot_size;
+    cache_next = src.cache_next;
+    cache_fill = src.cache_fill;
+    fill_pos = src.fill_pos;
+    line_len = src.line_len;
+    line_hash = src.line_hash;
+    fill_line_len = src.fill_line_len;
+    in_ptr = src.in_ptr;
+    in_left = src.in_left;
+    cache_hits = src.cache_hits;
+    cache_misses = src.cache_misses;
+    bl_line = src.bl_line;
+    backlog = src.backlog;
+    bl_size = src.bl_size;
+    bl_used = src.bl_used;
+    bl_start = src.bl_start;
+    bl_taken = src.bl_taken;
+    bl_held = src.bl_held;
+    line_sum = src.line_sum;
+    sum_got = src.sum_got;
+    sum_digits = src.sum_digits;
+    hist = src.hist;
+    hist_cmds = src.hist_cmds;
+    hist_cmd = src.hist_cmd;
+    hist_t0 = src.hist_t0;
+    hist_marks = src.hist_marks;
+    rate = src.rate;
+    flow_high = src.flow_high;
+    flow_low = src.flow_low;
+    flow_hook = src.flow_hook;
+    flow_stopped = src.flow_stopped;
+    trace_buf = src.trace_buf;
+    trace_cap = src.trace_cap;
+#if defined(HOST_CMD_STATS)
+    stats = src.stats;
+#endif
 }
 
 host_command::~host_command()
@@ -183,7 +509,9 @@ host_command::~host_command()
 
     while ( ! commands.empty() )
     {
-        delete commands.back();
+        if ( ! shared_commands )
+            delete commands.back();
+
         commands.pop_back();
     }
 }
@@ -195,12 +523,47 @@ host_command::~host_command()
  */
 void host_command::init_for_new_input( uint32_t _state )
 {
+    if ( hist_cmd >= 0 ) // the reported command is done with
+        hist_note( hc_latency_done );
+
+    if ( hist_cmd >= 0 || state != hc_state_clean ) // the next command is timed anew
+    {
+        hist_cmd = -1;
+        hist_marks = 0;
+    }
+
+    if ( trace_buf != nullptr && ( state != hc_state_clean || _state != hc_state_clean ) )
+        trace( hc_trace_reset, (_state & hc_state_invalid) && ! (_state & hc_state_EOL) ? 1 : 0 );
+
+#if defined(HOST_CMD_STATS)
+    if ( (state & hc_state_invalid) && ! (_state & hc_state_invalid) ) // the invalid input is skipped at last
+        ++stats.invalid;
+#endif
     cur_cmd = -1;
     cur_param = -1;
     buf_pos = 0;
     state = _state;
     buf[0] = '\0';
     err_code = 0;
+    streamed_len = 0;
+    dec_acc = 0;
+    dec_bits = 0;
+    reset_checksum();
+}
+
+/**
+ * @brief Internal: set the error code of input processing. it is counted if the stats are on
+ *
+ * The definition errors of new_command() and add_*_param() are just stored in err_code: they are not the input's.
+ * @param int: error code (hc_error_*)
+ */
+void host_command::set_error( int _code )
+{
+    err_code = _code;
+    hc_stat( errors[ _code ]++ );
+
+    if ( trace_buf != nullptr )
+        trace( hc_trace_error, static_cast<uint8_t>( _code ) );
 }
 
 /**
@@ -233,656 +596,3754 @@ void host_command::allow_escape( bool _mode )
 }
 
 /**
- * @brief sets maximum time for internal processes. Use to prevent timely blocks on long inputs.
- * 
- * @param int _millis: milliseconds. set < 0 for no timeout
+ * @brief Allow text lines to be prefixed with sequence number tag: "@number command params"
+ *
+ * For every tagged line the reply is sent back to the source when the command is done with:
+ * "ACK number" if all went OK or "NAK number error_code" otherwise.
+ * The commands stored in batch or backlog are replied to when reported from there or dropped.
+ * So the host may send many commands without waiting and then resend the failed ones only.
+ *
+ * @param bool: _mode
  */
-void host_command::limit_time( int _millis )
+void host_command::allow_sequence( bool _mode )
 {
-    max_time = _millis;
-}
+    if ( _mode )
+        flags |= hc_flag_sequence;
+    else
+        flags &= ~hc_flag_sequence;
 
+    seq = -1;
+}
 
-/** @brief Define the new command in full. Use for quick, C-style definitions
+/**
+ * @brief Set the char that separates several commands on the same line. ';' by default
  *
- * The second parameter uses printf-like codes to define command parameters if any.
- * The format is: [?][length]type, where:
- *   ? - this marks the beginning of optional parameters
- *   length - integer. set _maximum_ input length.
- *   type - printf-like: b-bool, c-byte, d-int, f-float, s-string, q-quoted string
- *          see known_command_codes enum
+ * The separator ends the command just like EOL does, unless it is escaped or inside of quoted string.
  *
- * @param const char*: command name
- * @param const char*: parameters definition
- * @return int: -1 if _params are incorrect or number of parameters recorded
+ * @param char: _sep - new separator or '\0' to have one command per line only
  */
-int host_command::new_command( const char* _name, const char* _params )
+void host_command::set_separator( char _sep )
 {
-    if ( ! new_command( _name ) )
-        return -1;
-
-    host_command_element* cmd = commands.back();
-
-    uint32_t param_info = 0;
-    uint32_t param_len = 0;
-    int _plen = strlen(_params);
-
-    for ( unsigned i = 0; i < _plen; ++i )
-    {
-        switch ( _params[i] )
-        {
-            case command_code_optional:
-                if ( cmd->params.size() == 0 || cmd->optional_start != INT_MAX )
-                {
-                    err_code = hc_error_invalid_param_spec;
-                    return -1;
-                }
+    separator = _sep;
+}
 
-                cmd->optional_start = static_cast<int>(cmd->params.size());
-                break;
-            case command_code_bool:
-                param_info |= hcmd_t_bool;
-                break;
-            case command_code_byte:
-                param_info |= hcmd_t_byte;
-                break;
-            case command_code_int:
-                param_info |= hcmd_t_int;
-                break;
-            case command_code_float:
-                param_info |= hcmd_t_float;
-                break;
-            case command_code_qstr:
-                param_info |= hcmd_t_qstr;
-                if (param_len == 0)
-                    param_len = buf_len - 1;
-                break;
-            case command_code_str:
-                param_info |= hcmd_t_str;
-                if (param_len == 0)
-                    param_len = buf_len - 1;
-                break;
+/**
+ * @brief Set the storage for command batches and enable BEGIN, COMMIT and ABORT words
+ *
+ * After BEGIN the commands are parsed completely and stored in compact form, with arguments already converted.
+ * They are not reported by get_next_command() until COMMIT arrives. Then all of them are reported back-to-back,
+ * right from the storage. If any of the batch's commands was invalid or the storage is full, the whole batch is dropped.
+ * ABORT drops the batch too.
+ *
+ * @param uint8_t*: storage or nullptr to disable batches
+ * @param long: storage size
+ */
+void host_command::set_batch_buffer( uint8_t* _storage, long _size )
+{
+    rec_buf = _storage;
+    rec_size = _storage == nullptr ? 0 : _size;
+    rec_used = 0;
+    rec_start = -1;
+    batch_open = false;
+
+    if ( _storage != nullptr )
+        flags |= hc_flag_batches;
+    else
+        flags &= ~hc_flag_batches;
+}
 
-            default:
-                if ( isdigit( _params[i] ) ) // length
-                {
-                    param_len = param_len * 10u + _params[i] - '0';
+/**
+ * @brief Set the storage for the cache of recently parsed lines
+ *
+ * When the line is the same as one of the recent ones, its command is reported right from the cache,
+ * with no tokenizing and conversions. The storage is used for the line buffer of the same size as the main one,
+ * and the rest is split into slots, each keeping one line and its command in compact form.
+ * Only the lines with a single command that fit into the slot together with it and have no streamed parameters are cached.
+ *
+ * @param uint8_t*: storage or nullptr to disable the cache
+ * @param long: storage size
+ * @param uint8_t: number of slots
+ * @return bool: false if the storage is too small for the buffer and slots
+ */
+bool host_command::set_line_cache( uint8_t* _storage, long _size, uint8_t _slots )
+{
+    cache = nullptr;
+    cache_slots = 0;
+    cache_fill = -1;
+    line_len = 0;
 
-                    if ( param_len == 0 ) // leading zero most probably is a mistake
-                    {
-                        err_code = hc_error_bad_length;
-                        commands.pop_back(); // try to do basic clean up. Probably not worth it anyway
-                        return -1;
-                    }
-                }
+    if ( _storage == nullptr || _slots == 0 )
+        return _storage == nullptr;
 
-                else if ( isspace(_params[i]) ) // allow spaces for readability
-                {
-                    continue;
-                }
+    long slot_size = ( _size - buf_len ) / _slots;
 
-                else
-                {
-                    err_code = hc_error_bad_pcode;
-                    commands.pop_back(); // try to do a basic clean up. Probably not worth it anyway
-                    return -1;
-                }
-        } // switch (_params[i])
+    if ( slot_size < cache_slot_header + 4 ) // room for a record of command with no parameters at least
+        return false;
 
-        if ( param_info & 0x00ff0000 ) // command type is set - saving
-        {
-            if ( param_info & (hcmd_t_qstr | hcmd_t_str) ) // check length attribute validity
-            {
-                if ( param_len < 1 || static_cast<int>(param_len) > buf_len - 1 ) //overflow?
-                {
-                    err_code = hc_error_bad_length;
-                    commands.pop_back(); // try to do a basic clean up. Probably not worth it anyway
-                    return -1;
-                }
-            }
+    cache = _storage;
+    cache_slots = _slots;
+    cache_slot_size = slot_size > INT_MAX ? INT_MAX : static_cast<int>( slot_size );
+    cache_next = 0;
+    cache_hits = cache_misses = 0;
 
-            cmd->params.push_back( param_info | param_len );
-            param_info = param_len = 0;
-        }
-    } // end of scan through _params
+    for ( int i = 0; i < cache_slots; ++i ) // all empty
+        memset( cache + buf_len + i * cache_slot_size, 0, cache_slot_header );
 
-    return static_cast<int>( cmd->params.size() );
+    return true;
 }
 
-/** @brief Start to define a new command. Use this for relaxed, step by step definitions
+/**
+ * @brief Return the number of lines that were found in the cache
  *
- * @param const char*: command name
- * @return bool: if added OK
+ * @return unsigned long
  */
-bool host_command::new_command( const char* _name )
+unsigned long host_command::get_cache_hits(void) const
 {
-    if ( find_command_index( _name ) != -1 )
-    {
-        err_code = hc_error_duplicate_command;
-        return false;
-    }
-
-    host_command_element* cmd = new host_command_element;
-    cmd->name = _name;
-    cmd->optional_start = INT_MAX;
-    commands.push_back( cmd );
-
-    return true;
+    return cache_hits;
 }
 
-/** @brief Continue to define a new command: add new boolean parameter
- *
- * A new_command() should be called before to have a command to add parameters to.
+/**
+ * @brief Return the number of lines that were not found in the cache and parsed as usual
  *
- * @return void
+ * @return unsigned long
  */
-void host_command::add_bool_param(void)
+unsigned long host_command::get_cache_misses(void) const
 {
-    commands.back()->params.push_back( hcmd_t_bool );
+    return cache_misses;
 }
 
-/** @brief Continue to define a new command: add new parameter of a byte type
+/**
+ * @brief Set the storage for per command latency histograms and enable them
  *
- * A new_command() should be called before to have a command to add parameters to.
- * 
- * @return void
+ * Every command has hc_latency_phases histograms of hc_latency_buckets counters, in the order of command IDs.
+ * The time is counted in clock ticks (see set_clock()) from the first byte of command.
+ *
+ * @param uint32_t*: storage. nullptr to disable the histograms
+ * @param long: its length in counters. Define all the commands first: the ones not fitting are not counted
+ * @return bool: false if there is no room even for a single command
  */
-void host_command::add_byte_param(void)
+bool host_command::set_histograms( uint32_t* _storage, long _count )
 {
-    commands.back()->params.push_back( hcmd_t_byte );
+    long cmds = _count / ( hc_latency_phases * hc_latency_buckets );
+
+    hist = nullptr;
+    hist_cmds = 0;
+    hist_cmd = -1;
+    hist_marks = 0;
+
+    if ( _storage == nullptr )
+        return true;
+
+    if ( cmds == 0 )
+        return false;
+
+    hist = _storage;
+    hist_cmds = cmds > INT_MAX ? INT_MAX : static_cast<int>( cmds );
+    memset( hist, 0, sizeof(uint32_t) * hist_cmds * hc_latency_phases * hc_latency_buckets );
+
+    return true;
 }
 
-/** @brief Continue to define a new command: add new int parameter
+/**
+ * @brief Return the latency histogram of the command
  *
- * A new_command() should be called before to have a command to add parameters to.
- * 
- * @return void
+ * @param int: command's ID
+ * @param uint8_t: phase. see hc_latency_*
+ * @return const uint32_t*: hc_latency_buckets counters or nullptr if histograms are off or there is no such command
  */
-void host_command::add_int_param(void)
+const uint32_t* host_command::get_histogram( int _id, uint8_t _phase ) const
 {
-    commands.back()->params.push_back( hcmd_t_int );
+    if ( hist == nullptr || _id < 0 || _id >= hist_cmds || _id >= static_cast<int>( commands.size() ) || _phase >= hc_latency_phases )
+        return nullptr;
+
+    return hist + ( _id * hc_latency_phases + _phase ) * hc_latency_buckets;
 }
 
-/** @brief Continue to define a new command: add new float parameter
- *
- * A new_command() should be called before to have a command to add parameters to.
- * 
- * @return void
+/**
+ * @brief Internal: remember the time of the command's first byte, unless it is done already
  */
-void host_command::add_float_param(void)
+void host_command::hist_start(void)
 {
-    commands.back()->params.push_back( hcmd_t_float );
+    if ( hist == nullptr || (hist_marks & 1) )
+        return;
+
+    hist_t0 = clock_src();
+    hist_marks = 1;
 }
 
-/** @brief Continue to define a new command: add new unquoted string parameter
- *
- * A new_command() should be called before to have a command to add parameters to.
- * Error processing: if len is 0 or bigger than buffer length then error code will be set and len will be set to match buffer length - 1.
+/**
+ * @brief Internal: count the time passed since the first byte of the command reported, once per phase
  *
- * @param uint16_t len: maximum length of the string. Default is your buffer length - 1. Max is 65535.
- * @return void
+ * @param uint8_t: phase. see hc_latency_*
  */
-void host_command::add_str_param( uint16_t len = 65535 )
+void host_command::hist_note( uint8_t _phase )
 {
-    if ( len == 0 || len > buf_len - 1 ) //overflow?
+    uint8_t bit = 2 << _phase;
+
+    if ( hist_cmd >= hist_cmds || (hist_marks & bit) )
+        return;
+
+    hist_marks |= bit;
+
+    unsigned long ticks = clock_src() - hist_t0;
+    int bucket = 0;
+
+    while ( ticks != 0 && bucket < hc_latency_buckets - 1 ) // log2
     {
-        err_code = hc_error_bad_length;
-        len = buf_len - 1;
+        ticks >>= 1;
+        ++bucket;
     }
 
-    commands.back()->params.push_back( hcmd_t_str | len );
+    ++hist[ ( hist_cmd * hc_latency_phases + _phase ) * hc_latency_buckets + bucket ];
 }
 
-/**@brief Continue to define a new command: add new quoted string parameter
+/**
+ * @brief Set the storage for the ring of recent parser events and enable it
  *
- * A new_command() should be called before to have a command to add parameters to.
+ * If the storage has the trace of the same capacity already, e.g. it is in RAM surviving the reset,
+ * then the new events are added to it. Use dump_trace() to see them.
  *
- * @param uint16_t len: maximum length of the string w/o quotes. Default is your buffer length - 3. Max is 65535.
- * @return void
+ * @param uint8_t*: storage. nullptr to disable the trace
+ * @param long: its size: hc_trace_header + N * hc_trace_event bytes, up to 65535 events
+ * @return bool: false if there is no room even for the single event
  */
-void host_command::add_qstr_param( uint16_t len = 65535 )
+bool host_command::set_trace( uint8_t* _storage, long _size )
 {
-    if ( len == 0 || len > buf_len - 3 || buf_len < 4 ) //overflow?
+    long cap = ( _size - hc_trace_header ) / hc_trace_event;
+
+    trace_buf = nullptr;
+    trace_cap = 0;
+
+    if ( _storage == nullptr )
+        return true;
+
+    if ( cap <= 0 )
+        return false;
+
+    if ( cap > 0xFFFF )
+        cap = 0xFFFF;
+
+    trace_cap = static_cast<uint16_t>( cap );
+
+    if ( memcmp( _storage, trace_magic, 4 ) != 0 || ( _storage[4] | (_storage[5] << 8) ) != trace_cap
+         || ( _storage[6] | (_storage[7] << 8) ) >= trace_cap || ( _storage[8] | (_storage[9] << 8) ) > trace_cap )
     {
-        err_code = hc_error_bad_length;
-        len = buf_len - 3;
+        memcpy( _storage, trace_magic, 4 );
+        _storage[4] = static_cast<uint8_t>( trace_cap );
+        _storage[5] = static_cast<uint8_t>( trace_cap >> 8 );
+        memset( _storage + 6, 0, hc_trace_header - 6 ); // empty
     }
 
-    commands.back()->params.push_back( hcmd_t_qstr | len );
-}
+    trace_buf = _storage;
 
-/**@brief Continue to define a new command: inform that the next added parameters will be treated as optional
- * 
- * A new_command() should be called before to have a command to add parameters to.
- * Error processing: if there are no parameters yet or optional parameters were already marked
- * then no error will be generated and previous state will be unchanged.
+    return true;
+}
+
+/**
+ * @brief Print the trace ring's events as hex lines, the oldest first
  *
- * @return void
+ * The format is: "TRACE <number of events>", then the line of 16 hex digits per event and "END".
+ * tools/hc_trace.py decodes it.
+ *
+ * @param Stream*: destination. nullptr - the commands' source
  */
-void host_command::optional_from_here(void)
+void host_command::dump_trace( Stream* _dst )
 {
-    if ( commands.size() == 0 )
-        return;
+    static const char hex[] = "0123456789ABCDEF";
 
-    auto cmd = commands.back();
+    if ( _dst == nullptr )
+        _dst = source;
 
-    if ( cmd->optional_start == INT_MAX )
-        cmd->optional_start = static_cast<int>( cmd->params.size() );
+    int count = trace_buf == nullptr ? 0 : trace_buf[8] | (trace_buf[9] << 8);
+    int pos = trace_buf == nullptr ? 0 : trace_buf[6] | (trace_buf[7] << 8);
+
+    pos = count < trace_cap ? 0 : pos; // the oldest one is overwritten next if the ring is full
+
+    _dst->print( "TRACE " );
+    _dst->println( count );
+
+    for ( int i = 0; i < count; ++i )
+    {
+        const uint8_t* e = trace_buf + hc_trace_header + pos * hc_trace_event;
+        char line[ 2 * hc_trace_event + 1 ];
+
+        for ( int j = 0; j < hc_trace_event; ++j )
+        {
+            line[ 2 * j ] = hex[ e[j] >> 4 ];
+            line[ 2 * j + 1 ] = hex[ e[j] & 0xF ];
+        }
+
+        line[ 2 * hc_trace_event ] = '\0';
+        _dst->println( line );
+
+        if ( ++pos == trace_cap )
+            pos = 0;
+    }
+
+    _dst->println( "END" );
 }
 
 /**
-* @brief Request to get the next command from the input
-*
-* @return bool: false if none or error, or true if new command has arrived
-*/
-bool host_command::get_next_command(void)
+ * @brief Internal: add the event to the trace ring. The ring's position is kept in the storage's header only
+ *
+ * @param uint8_t: kind. see hc_trace_*
+ * @param uint8_t: kind-specific argument
+ */
+void host_command::trace( uint8_t _kind, uint8_t _arg )
 {
-    if ( is_command_complete() )
-        discard();
+    uint16_t pos = trace_buf[6] | (trace_buf[7] << 8);
+    uint8_t* e = trace_buf + hc_trace_header + pos * hc_trace_event;
+
+    put_le32( e, static_cast<uint32_t>( clock_src() ) );
+    e[4] = _kind;
+    e[5] = cur_cmd < 0 ? 0xFF : ( cur_cmd > 0xFE ? 0xFE : static_cast<uint8_t>( cur_cmd ) );
+    e[6] = cur_param < 0 ? 0xFF : ( cur_param > 0xFE ? 0xFE : static_cast<uint8_t>( cur_param ) );
+    e[7] = _arg;
+
+    if ( ++pos == trace_cap )
+        pos = 0;
+
+    trace_buf[6] = static_cast<uint8_t>( pos );
+    trace_buf[7] = static_cast<uint8_t>( pos >> 8 );
+
+    if ( ( trace_buf[8] | (trace_buf[9] << 8) ) < trace_cap )
+    {
+        uint16_t count = ( trace_buf[8] | (trace_buf[9] << 8) ) + 1;
 
-    return check_input() > 0;
+        trace_buf[8] = static_cast<uint8_t>( count );
+        trace_buf[9] = static_cast<uint8_t>( count >> 8 );
+    }
 }
 
+#if defined(HOST_CMD_STATS)
 /**
-* @brief Return currently processed command's index
-*
-* @return int: -1 if none or index of new command available
-*/
-int host_command::get_command_id(void)
+ * @brief Return the copy of input processing counters
+ *
+ * @return host_command_stats
+ */
+host_command_stats host_command::get_stats(void) const
 {
-    return cur_cmd;
+    return stats;
 }
 
 /**
-* @brief Return the name of the command being currently processed
-*
-* @return const char*: empty if no current command 
-*/
-const char*host_command::get_command_name(void)
+ * @brief Return the number of times the command was reported by get_next_command()
+ *
+ * @param int: command's ID
+ * @return unsigned long: 0 if there is no such command
+ */
+unsigned long host_command::get_command_stats( int _id ) const
 {
-    if ( cur_cmd == -1 )
-        return "";
+    if ( _id < 0 || _id >= static_cast<int>( commands.size() ) )
+        return 0;
 
-    return commands[cur_cmd]->name;
+    return commands[_id]->reported;
 }
 
 /**
-* @brief Check if current command processing is invalidated
-*
-* @return bool: true if something got broken
-*/
-bool host_command::is_invalid_input(void) const
+ * @brief Zero all the input processing counters, including the commands' ones
+ */
+void host_command::reset_stats(void)
 {
-    return state & hc_state_invalid;
+    memset( &stats, 0, sizeof(stats) );
+
+    for ( auto cmd : commands )
+        cmd->reported = 0;
 }
+#endif
 
 /**
-* @brief Check if current command processing is formally done
-*
-* Note that return valuee here depends not only on error, no command,
-* or command with EOL received, but also
-*     1) if current parameter is optional
-*     2) or if current parameter is the last by definition and received complete
-*
-* @return bool: true if complete
-*/
-bool host_command::is_command_complete(void) const
+ * @brief Enable or disable the backlog: all the available lines are read ahead and parsed into stored commands
+ *
+ * The commands are reported by get_next_command() from the backlog, so it may drop the superseded ones,
+ * see coalesce_by(), and report the urgent ones first, see set_priority(). The storage starts with the line buffer, as large as the buffer given to constructor,
+ * the rest keeps the records of commands, the same as in batches. A line is parsed only when it is complete
+ * and there is a room for its commands. Otherwise it waits, as well as the rest of input.
+ * Commands with streamed parameters can't be stored. Binary frames do not use the backlog.
+ *
+ * @param uint8_t*: storage or nullptr to disable the backlog
+ * @param long: storage size. at least 3 times of the buffer size + 3
+ * @return bool: false if the storage is too small
+ */
+bool host_command::set_backlog( uint8_t* _storage, long _size )
 {
-    if( cur_cmd == -1 || ( state & (hc_state_EOL | hc_state_invalid) )
-        || is_optional() 
-        || commands[cur_cmd]->params.size() == 0 )
+    bl_line = backlog = nullptr;
+    bl_size = bl_used = 0;
+    bl_start = bl_taken = -1;
+    bl_held = 0;
+    line_len = 0;
+    in_ptr = nullptr;
+    in_left = 0;
+
+    if ( _storage == nullptr )
         return true;
 
-    // if it is the last parameter and is already complete?
-    return ( state & hc_state_complete ) &&
-           ( cur_param + 1 == static_cast<int>( commands[cur_cmd]->params.size() ) );
-}
-
-/**
-* @brief Requests to get the next parameter from the input
-*
-* @return int: false if none/error or true if new parameter's data is available
-*/
-bool host_command::has_next_parameter(void)
-{
-    if ( no_more_parameters() )
+    if ( _size < 3L * buf_len + 3 ) // the line buffer and commands of the longest line
         return false;
-        
-    return check_input() > 0;
+
+    bl_line = _storage;
+    backlog = _storage + buf_len;
+    bl_size = _size - buf_len;
+
+    return true;
 }
 
 /**
-* @brief Return current parameter's index
-*
-* @return int: -1 if none or index of new parameter available
-*/
-int host_command::get_parameter_index(void)
+ * @brief Parse the text commands from the given source into compact records, e.g. to replay them on every boot
+ *
+ * Records are the same as in batches: 2 bytes of little-endian length of the rest,
+ * command index and then parameters' fields as in binary frames. So they depend on the order of new_command() calls.
+ * The result may be stored in a file or flash and passed to replay() later.
+ * The text is parsed by the temporary parser with the default settings: plain text lines, ';' separator, escapes,
+ * no checksums, sequence tags or batches. So this instance's settings and the command being processed are not touched.
+ * The temporary parser takes the buffer of the same size from the heap.
+ *
+ * @param Stream*: text commands source. All its data is processed. Every command should end with EOL
+ * @param uint8_t*: destination
+ * @param long: destination size
+ * @return long: the length of records or -1 on error. See errstr() for the reason
+ */
+long host_command::compile( Stream* _text, uint8_t* _out, long _size )
 {
-    if ( cur_cmd == -1 )
+    if ( _text == nullptr || _out == nullptr )
         return -1;
 
-    return cur_param;
+    host_command hc( buf_len, _text );
+    long result = 0;
+
+    hc.share_commands( *this );
+    hc.rec_buf = _out; // borrowing the batch machinery
+    hc.rec_size = _size;
+
+    for(;;)
+    {
+        int rc = hc.check_input();
+
+        if ( rc == 0 ) // all done or the last command is cut short
+        {
+            if ( hc.state & hc_state_got_some )
+            {
+                hc.set_error( hc_error_required_missing );
+                result = -1;
+            }
+
+            break;
+        }
+
+        if ( rc > 0 )
+            rc = hc.capture( hc_error_bad_batch );
+
+        if ( rc <= 0 )
+        {
+            if ( hc.err_code == hc_error_no_error )
+                hc.set_error( hc_error_required_missing );
+
+            result = -1;
+            break;
+        }
+
+        hc.discard();
+    }
+
+    if ( result < 0 )
+        set_error( hc.err_code );
+    else
+        result = hc.rec_used;
+
+    return result;
 }
 
 /**
- * @brief return the value of the current parameter to be extracted.
+ * @brief Report the stored records made by compile() as the commands, before anything else
  *
- * @return uint32_t info bitmask or 0 if something wrong
+ * The commands are reported by get_next_command() the same way as if they have arrived from the source,
+ * but without any parsing. The records' memory should stay intact until all of them are reported.
+ *
+ * @param const uint8_t*: records
+ * @param long: records' length
+ * @return bool: false if parameters are invalid or the previous replay is not done yet
  */
-uint32_t host_command::get_parameter_info(void)
+bool host_command::replay( const uint8_t* _records, long _len )
 {
-    if ( cur_cmd == -1 || cur_param == -1 )
-        return 0;
+    if ( _records == nullptr || _len < 0 || play_left > 0 )
+        return false;
 
-    return commands[cur_cmd]->params[cur_param];
+    play_ptr = _records;
+    play_left = _len;
+
+    return true;
 }
 
 /**
- * @brief return true if current parameter is optional.
+ * @brief Return true if the batch is being collected, i.e. BEGIN arrived and COMMIT or ABORT are not yet
  *
  * @return bool
  */
-bool host_command::is_optional(void) const
+bool host_command::is_batch_open(void) const
 {
-    if( cur_cmd == -1 || cur_param == -1 )
-        return false;
-    
-    return cur_param >= commands[cur_cmd]->optional_start;
+    return batch_open;
 }
 
 /**
- * @brief return true if all possible parameters were received, including optional ones
+ * @brief Return true if the sender was asked to stop by flow control
  *
  * @return bool
  */
-bool host_command::no_more_parameters(void) const
+bool host_command::is_input_paused(void) const
 {
-    if( cur_cmd == -1 || state & ( hc_state_EOL | hc_state_invalid )
-        || commands[cur_cmd]->params.size() == 0 )
-        return true;
+    return flow_stopped;
+}
 
-    // if it is the last parameter and is already complete?
-    return ( state & hc_state_complete ) && 
-           ( cur_param + 1 == static_cast<int>( commands[cur_cmd]->params.size() ) );
-} 
+/**
+ * @brief Switch the wire protocol between text lines and binary frames
+ *
+ * The processing methods and getters work the same way in all modes.
+ * Current command's processing is discarded.
+ *
+ * @param uint8_t: hc_framing_text, hc_framing_slip or hc_framing_cobs
+ */
+void host_command::set_framing( uint8_t _mode )
+{
+    flags &= ~hc_flag_framing;
+
+    if ( _mode == hc_framing_slip )
+        flags |= hc_flag_slip;
+    else if ( _mode == hc_framing_cobs )
+        flags |= hc_flag_cobs;
+
+    cobs_left = cobs_code = 0;
+    init_for_new_input( hc_state_clean );
+}
 
 /**
-* @brief Discard the current input and force wait for a new command to arrive if needed
-*
-* @return void
-*/
-void host_command::discard(void)
+ * @brief Require text lines to end with the checksum: "command params*hh" or "command params*hhhh"
+ *
+ * The checksum covers all the line's chars before '*', EOL excluded.
+ * Unescaped '*' outside of quoted strings starts the checksum then.
+ * The command is reported complete only after the checksum is verified on EOL.
+ * With the storage given, the command is parsed completely into it first, as in batches, and it is reported
+ * only after the checksum is verified. So no parameter of the corrupted line reaches the handler.
+ *
+ * @param uint8_t: hc_checksum_none, hc_checksum_xor or hc_checksum_crc16
+ * @param uint8_t*: storage for the command's record or nullptr to report the parameters as they arrive
+ * @param long: storage size. the command that does not fit is invalid, as the too long one
+ */
+void host_command::set_checksum( uint8_t _mode, uint8_t* _storage, long _size )
 {
-    if (state == hc_state_clean || state & hc_state_EOL)
-        init_for_new_input( hc_state_clean ); // Clean or already got EOL. Just marking as clean
-    else
-        init_for_new_input( hc_state_invalid ); // Will wait for EOL
+    flags &= ~hc_flag_checksum;
+    hold_buf = _storage;
+    hold_size = _storage == nullptr ? 0 : _size;
+    hold_used = 0;
+    hold_start = -1;
+
+    if ( _mode == hc_checksum_xor )
+        flags |= hc_flag_xor;
+    else if ( _mode == hc_checksum_crc16 )
+        flags |= hc_flag_crc16;
+
+    init_for_new_input( hc_state_clean );
 }
 
 /**
- * @brief Internal: Check if there is new command/parameter available to process
+ * @brief Set the receiver of streamed parameters' data
+ *
+ * The sink is called every time the buffer is full and once more at the end of parameter with the last flag set.
+ *
+ * @param host_command_sink: callback or nullptr to drop the streamed data
+ */
+void host_command::set_sink( host_command_sink _sink )
+{
+    sink = _sink;
+}
+
+/**
+ * @brief sets maximum time for internal processes. Use to prevent timely blocks on long inputs.
  * 
- * To have a low-memory footprint we'll store and scan one parameter at the time maximum.
+ * @param int _millis: milliseconds. set < 0 for no timeout
+ */
+void host_command::limit_time( int _millis )
+{
+    max_time = _millis;
+}
+
+/**
+ * @brief Limit the input processed by a single call of get_next_command() or has_next_parameter()
  *
- * @return int: -1 on error, 0 if no new data arrived yet, 1 if some
+ * When the budget is spent the call returns as if there is no more data yet and the next call resumes
+ * from the same point, even in the middle of a word. Use it to keep the worst-case cost of a call in hard real-time loops.
+ * The clock is read once per 16 bytes, so the time may be exceeded by the time of processing of that many bytes.
+ *
+ * @param int _bytes: max input bytes per call. set <= 0 for no limit
+ * @param long _us: max time per call in microseconds. set <= 0 for no limit
  */
-int host_command::check_input(void)
+void host_command::limit_work( int _bytes, long _us )
 {
-    // checking for previous act's completion and moving forward if necessary
-    if ( cur_cmd > -1 && (state & hc_state_complete) ) // have previous parameter complete
+    work_bytes = _bytes;
+    work_us = _us;
+    start_work();
+}
+
+/**
+ * @brief Internal: renew the per-call budget. See limit_work()
+ */
+void host_command::start_work(void)
+{
+    work_left = work_bytes > 0 ? work_bytes : INT_MAX;
+    work_count = 0;
+    set_deadline( work_deadline, us_to_ticks( work_us ) );
+}
+
+/**
+ * @brief Internal: take the bytes about to be processed from the per-call budget
+ *
+ * @param int - number of bytes wanted
+ * @return int: number of bytes allowed. 0 if the budget is spent
+ */
+int host_command::spend_work( int _bytes )
+{
+    if ( _bytes > work_left )
+        _bytes = work_left;
+
+    work_left -= _bytes;
+
+    if ( work_deadline.span > 0 && _bytes > 0 )
     {
-        // if got all params already and we're in the complete state, then init for next command
-        if ( cur_param + 1 == static_cast<int>( commands[ cur_cmd ]->params.size() ) ) // no params or last one
+        if ( _bytes >= work_clock_every - work_count ) // it's time to check the clock
         {
-            init_for_new_input( hc_state_clean );
-        }
+            work_count = 0;
 
-        else // we'll wait for the next parameter then
-        {
-            cur_param++;
-            state = hc_state_param; // we need to reset previous parameter state completely
-            buf_pos = 0;
+            if ( is_past( work_deadline ) )
+                work_left = 0;
         }
-    }
 
-    if ( state & hc_state_EOL ) // maybe got a command with no params or EOL on optional params
-    {
-        init_for_new_input( hc_state_clean );
+        else
+            work_count += _bytes;
     }
 
-    unsigned work_till = 0; // unititalized state
+    return _bytes;
+}
 
-    for(;;) // we'll loop while there is still some data in the stream... or time is out
+/**
+ * @brief Set the clock used for all the timeouts and time limits
+ *
+ * Any clock wrapping around at ULONG_MAX will do: micros(), millis() or a wrapper of steady_clock, a hardware timer, etc.
+ * The timeouts are limited to a half of the clock's range: ~35 minutes for 32-bit micros().
+ * Use millis() if you need the longer ones and do not need the microseconds resolution of limit_work().
+ *
+ * @param host_command_clock _clock: clock or nullptr for the default micros()
+ * @param unsigned long _per_ms: clock ticks per millisecond
+ */
+void host_command::set_clock( host_command_clock _clock, unsigned long _per_ms )
+{
+    if ( _clock == nullptr || _per_ms == 0 )
     {
-        if ( work_till ) // timeout is set - checking
-        {
-            if ( millis() >= work_till )
-                return -1;
-        }
-        else // set timeout
-        {
-            work_till = max_time > 0 ? millis() + max_time : ULONG_MAX;
-        }
+        _clock = micros;
+        _per_ms = 1000;
+    }
 
-        int c = source->available();
+    clock_src = _clock;
+    clock_per_ms = _per_ms;
+}
 
-        if ( c < 0 ) // some error
-            return -1;
-        
-        if ( c == 0 ) // nothing yet
-            return 0;
+/**
+ * @brief Limit the rate of all the commands reported. See set_rate_limit() for the details
+ *
+ * @param int: number of commands. <= 0 - no limit
+ * @param long: period in milliseconds. <= 0 - no limit
+ */
+void host_command::limit_rate( int _count, long _ms )
+{
+    set_bucket( rate, _count, _ms );
+}
 
-        if ( buf_pos == buf_len ) // overflow. discarding command
-        {
-            if (flags & hc_flag_interactive)
-            {
-                source->println("\n? Too long input. Will be discarded till EOL.");
+/**
+ * @brief Return the number of commands rejected by rate limits
+ *
+ * @param int: command's ID or -1 for all the commands
+ * @return unsigned long: 0 if there is no such command
+ */
+unsigned long host_command::get_rejected( int _id ) const
+{
+    if ( _id == -1 )
+        return rate.rejected;
+
+    if ( _id < 0 || _id >= static_cast<int>( commands.size() ) )
+        return 0;
+
+    return commands[_id]->rate.rejected;
+}
+
+/**
+ * @brief Internal: set up the token bucket. It starts full
+ *
+ * @param host_command_bucket&: bucket
+ * @param int: number of commands, i.e. tokens. <= 0 - no limit
+ * @param long: period in milliseconds to get all the tokens back. <= 0 - no limit
+ */
+void host_command::set_bucket( host_command_bucket& _b, int _count, long _ms )
+{
+    if ( _count <= 0 || _ms <= 0 )
+    {
+        _b.interval = 0;
+        return;
+    }
+
+    _b.burst = _count > 0xFFFF ? 0xFFFF : static_cast<uint16_t>( _count );
+    _b.tokens = _b.burst;
+    _b.interval = ms_to_ticks( _ms ) / _b.burst;
+
+    if ( _b.interval == 0 )
+        _b.interval = 1;
+
+    _b.last = clock_src();
+}
+
+/**
+ * @brief Internal: add the tokens earned since the last time. Idle time is counted up to the half of clock's range
+ *
+ * @param host_command_bucket&: bucket
+ */
+void host_command::refill( host_command_bucket& _b )
+{
+    unsigned long passed = clock_src() - _b.last;
+
+    if ( passed < _b.interval )
+        return;
+
+    unsigned long add = passed / _b.interval;
+
+    if ( add >= static_cast<unsigned long>( _b.burst - _b.tokens ) ) // full
+    {
+        _b.tokens = _b.burst;
+        _b.last += passed;
+    }
+
+    else
+    {
+        _b.tokens += static_cast<uint16_t>( add );
+        _b.last += add * _b.interval; // the part of interval passed is kept
+    }
+}
+
+/**
+ * @brief Internal: take the tokens of the instance and of the current command, if both have them
+ *
+ * @return bool: false if the command is over any limit. It is counted as rejected then
+ */
+bool host_command::take_rate(void)
+{
+    host_command_bucket& cmd = commands[cur_cmd]->rate;
+
+    if ( rate.interval == 0 && cmd.interval == 0 ) // fast path: no limits
+        return true;
+
+    if ( rate.interval != 0 )
+        refill( rate );
+
+    if ( cmd.interval != 0 )
+        refill( cmd );
+
+    if ( ( rate.interval != 0 && rate.tokens == 0 ) || ( cmd.interval != 0 && cmd.tokens == 0 ) )
+    {
+        ++rate.rejected;
+        ++cmd.rejected;
+
+        return false;
+    }
+
+    if ( rate.interval != 0 )
+        --rate.tokens;
+
+    if ( cmd.interval != 0 )
+        --cmd.tokens;
+
+    return true;
+}
+
+/**
+ * @brief Internal: take the tokens for all the commands of the batch being committed at once
+ *
+ * The played records are not checked one by one then, so the batch can't be cut in the middle by the limits.
+ *
+ * @return bool: false if the batch is over any limit. All of its commands are counted as rejected then
+ */
+bool host_command::take_batch_rate(void)
+{
+    long count = 0;
+    bool over = false;
+
+    for ( long pos = 0; pos + 2 < rec_used; pos += 2 + ( rec_buf[ pos ] | (rec_buf[ pos + 1 ] << 8) ) )
+    {
+        uint8_t id = record_body( rec_buf + pos )[0];
+        host_command_bucket& cmd = commands[ id ]->rate;
+        long same = 0;
+
+        ++count;
+
+        if ( cmd.interval == 0 )
+            continue;
+
+        for ( long p = 0; p + 2 < rec_used; p += 2 + ( rec_buf[ p ] | (rec_buf[ p + 1 ] << 8) ) )
+            if ( record_body( rec_buf + p )[0] == id )
+            {
+                if ( p < pos ) // counted already
+                {
+                    same = 0;
+                    break;
+                }
+
+                ++same;
+            }
+
+        if ( same == 0 )
+            continue;
+
+        refill( cmd );
+
+        if ( cmd.tokens < same )
+            over = true;
+    }
+
+    if ( rate.interval != 0 )
+    {
+        refill( rate );
+
+        if ( rate.tokens < count )
+            over = true;
+    }
+
+    for ( long pos = 0; pos + 2 < rec_used; pos += 2 + ( rec_buf[ pos ] | (rec_buf[ pos + 1 ] << 8) ) )
+    {
+        host_command_bucket& cmd = commands[ record_body( rec_buf + pos )[0] ]->rate;
+
+        if ( over )
+        {
+            ++rate.rejected;
+            ++cmd.rejected;
+        }
+
+        else if ( cmd.interval != 0 )
+            --cmd.tokens;
+    }
+
+    if ( ! over && rate.interval != 0 )
+        rate.tokens -= static_cast<uint16_t>( count );
+
+    return ! over;
+}
+
+/**
+ * @brief Set up the flow control: ask the sender to stop when too much input is waiting in the source
+ *
+ * The source's backlog is checked on every get_next_command() and has_next_parameter() call.
+ * The sender is stopped when it reaches the high watermark and resumed when it drops to the low one.
+ * Leave enough room above the high watermark for the bytes coming while the handler runs and the sender reacts.
+ *
+ * @param int: high watermark in bytes. <= 0 turns the flow control off, resuming the sender if needed
+ * @param int: low watermark in bytes. it is kept below the high one
+ * @param host_command_flow: hook to be called, e.g. to drive RTS. nullptr - XOFF/XON chars are sent to the source
+ */
+void host_command::set_flow_control( int _high, int _low, host_command_flow _hook )
+{
+    if ( flow_stopped )
+        set_flow( false );
+
+    flow_high = _high;
+    flow_low = _low < _high ? _low : _high - 1;
+    flow_hook = _hook;
+}
+
+/**
+ * @brief Internal: check the source's backlog against watermarks and stop or resume the sender
+ */
+void host_command::check_flow(void)
+{
+#if defined(HOST_CMD_STATS)
+    int depth = source->available();
+
+    if ( depth > 0 && static_cast<unsigned long>( depth ) > stats.depth_max )
+        stats.depth_max = depth;
+
+    if ( flow_high <= 0 )
+        return;
+#else
+    if ( flow_high <= 0 ) // nothing to check
+        return;
+
+    int depth = source->available();
+#endif
+
+    if ( ! flow_stopped && depth >= flow_high )
+        set_flow( true );
+    else if ( flow_stopped && depth <= flow_low )
+        set_flow( false );
+}
+
+/**
+ * @brief Internal: stop or resume the sender via the hook or XOFF/XON
+ *
+ * @param bool: true to stop
+ */
+void host_command::set_flow( bool _stop )
+{
+    flow_stopped = _stop;
+
+    if ( _stop )
+        hc_stat( flow_stops++ );
+
+    if ( flow_hook != nullptr )
+        flow_hook( this, _stop );
+    else
+        source->write( _stop ? flow_xoff : flow_xon );
+}
+
+/**
+ * @brief Internal: start counting the ticks till the deadline. The clock is not read if there is no deadline
+ *
+ * @param host_command_deadline& - deadline
+ * @param unsigned long - ticks. 0 for no deadline
+ */
+void host_command::set_deadline( host_command_deadline& _dl, unsigned long _ticks )
+{
+    _dl.span = _ticks;
+
+    if ( _ticks > 0 )
+        _dl.start = clock_src();
+}
+
+/**
+ * @brief Internal: check if the deadline has passed
+ *
+ * The elapsed ticks are counted with unsigned subtraction, so the clock's overflow is safe.
+ *
+ * @param const host_command_deadline& - deadline
+ * @return bool: true if the deadline is set and passed
+ */
+bool host_command::is_past( const host_command_deadline& _dl ) const
+{
+    return _dl.span > 0 && clock_src() - _dl.start >= _dl.span;
+}
+
+/**
+ * @brief Internal: convert milliseconds into the clock ticks, limited to a half of the clock's range
+ *
+ * @param long - milliseconds
+ * @return unsigned long: ticks or 0 if there is no limit
+ */
+unsigned long host_command::ms_to_ticks( long _ms ) const
+{
+    if ( _ms <= 0 )
+        return 0;
+
+    if ( static_cast<unsigned long>( _ms ) > ( ULONG_MAX / 2 ) / clock_per_ms )
+        return ULONG_MAX / 2;
+
+    return static_cast<unsigned long>( _ms ) * clock_per_ms;
+}
+
+/**
+ * @brief Internal: convert microseconds into the clock ticks, rounding up
+ *
+ * @param long - microseconds
+ * @return unsigned long: ticks or 0 if there is no limit
+ */
+unsigned long host_command::us_to_ticks( long _us ) const
+{
+    if ( _us <= 0 )
+        return 0;
+
+    unsigned long ticks = ms_to_ticks( _us / 1000 );
+
+    return ticks + ( static_cast<unsigned long>( _us % 1000 ) * clock_per_ms + 999 ) / 1000;
+}
+
+
+/** @brief Define the new command in full. Use for quick, C-style definitions
+ *
+ * The second parameter uses printf-like codes to define command parameters if any.
+ * The format is: [?][>][length]type, where:
+ *   ? - this marks the beginning of optional parameters
+ *   > - the data will be passed to the sink in chunks. Length is not limited by the buffer size then
+ *   length - integer. set _maximum_ input length. For hex and base64 - length of decoded data.
+ *   type - printf-like: b-bool, c-byte, d-int, f-float, s-string, q-quoted string,
+ *          x-hex encoded binary, m-base64 encoded binary, n-length-prefixed raw data: #length:data
+ *          see known_command_codes enum
+ *
+ * @param const char*: command name
+ * @param const char*: parameters definition
+ * @return int: -1 if _params are incorrect or number of parameters recorded
+ */
+int host_command::new_command( const char* _name, const char* _params )
+{
+    if ( ! new_command( _name ) )
+        return -1;
+
+    host_command_element* cmd = commands.back();
+
+    uint32_t param_info = 0;
+    uint32_t param_len = 0;
+    int _plen = strlen(_params);
+
+    cmd->params.reserve( _plen ); // every parameter takes a char at least. single allocation
+
+    for ( unsigned i = 0; i < _plen; ++i )
+    {
+        switch ( _params[i] )
+        {
+            case command_code_optional:
+                if ( cmd->params.size() == 0 || cmd->optional_start != INT_MAX )
+                {
+                    err_code = hc_error_invalid_param_spec;
+                    return -1;
+                }
+
+                cmd->optional_start = static_cast<int>(cmd->params.size());
+                break;
+            case command_code_bool:
+                param_info |= hcmd_t_bool;
+                break;
+            case command_code_byte:
+                param_info |= hcmd_t_byte;
+                break;
+            case command_code_int:
+                param_info |= hcmd_t_int;
+                break;
+            case command_code_float:
+                param_info |= hcmd_t_float;
+                break;
+            case command_code_qstr:
+                param_info |= hcmd_t_qstr;
+                if (param_len == 0 && ! (param_info & hcmd_f_stream))
+                    param_len = buf_len - 1;
+                break;
+            case command_code_str:
+                param_info |= hcmd_t_str;
+                if (param_len == 0 && ! (param_info & hcmd_f_stream))
+                    param_len = buf_len - 1;
+                break;
+            case command_code_hex:
+                param_info |= hcmd_t_blob | hcmd_f_hex;
+                if (param_len == 0 && ! (param_info & hcmd_f_stream))
+                    param_len = buf_len - 1;
+                break;
+            case command_code_base64:
+                param_info |= hcmd_t_blob | hcmd_f_base64;
+                if (param_len == 0 && ! (param_info & hcmd_f_stream))
+                    param_len = buf_len - 1;
+                break;
+            case command_code_netstring:
+                param_info |= hcmd_t_blob | hcmd_f_netstring;
+                if (param_len == 0 && ! (param_info & hcmd_f_stream))
+                    param_len = buf_len - 1;
+                break;
+            case command_code_stream:
+                param_info |= hcmd_f_stream;
+                break;
+
+            default:
+                if ( isdigit( _params[i] ) ) // length
+                {
+                    param_len = param_len * 10u + _params[i] - '0';
+
+                    if ( param_len == 0 ) // leading zero most probably is a mistake
+                    {
+                        err_code = hc_error_bad_length;
+                        commands.pop_back(); // try to do basic clean up. Probably not worth it anyway
+                        return -1;
+                    }
+                }
+
+                else if ( isspace(_params[i]) ) // allow spaces for readability
+                {
+                    continue;
+                }
+
+                else
+                {
+                    err_code = hc_error_bad_pcode;
+                    commands.pop_back(); // try to do a basic clean up. Probably not worth it anyway
+                    return -1;
+                }
+        } // switch (_params[i])
+
+        if ( param_info & 0x00ff0000 ) // command type is set - saving
+        {
+            if ( (param_info & hcmd_f_stream) && ! (param_info & (hcmd_t_qstr | hcmd_t_str | hcmd_t_blob)) ) // only strings and binary data can be streamed
+            {
+                err_code = hc_error_invalid_param_spec;
+                commands.pop_back(); // try to do a basic clean up. Probably not worth it anyway
+                return -1;
+            }
+
+            if ( param_info & hcmd_f_stream ) // the buffer is used for chunks only, so just keep the length in range
+            {
+                if ( param_len > 0xffff )
+                {
+                    err_code = hc_error_bad_length;
+                    commands.pop_back(); // try to do a basic clean up. Probably not worth it anyway
+                    return -1;
+                }
+            }
+
+            else if ( param_info & (hcmd_t_qstr | hcmd_t_str | hcmd_t_blob) ) // check length attribute validity
+            {
+                if ( param_len < 1 || static_cast<int>(param_len) > buf_len - 1 ) //overflow?
+                {
+                    err_code = hc_error_bad_length;
+                    commands.pop_back(); // try to do a basic clean up. Probably not worth it anyway
+                    return -1;
+                }
+            }
+
+            cmd->params.push_back( param_info | param_len );
+            param_info = param_len = 0;
+        }
+    } // end of scan through _params
+
+    return static_cast<int>( cmd->params.size() );
+}
+
+/** @brief Use the commands defined in the other instance instead of own ones
+ *
+ * Several instances reading different sources may have the single set of definitions this way.
+ * Only the list of pointers is copied, so the other instance should live longer and have all the commands defined already.
+ * The commands' rate limits and counters are common for all the sharing instances.
+ * New commands can't be defined in this instance after that.
+ *
+ * @param const host_command&: the instance having the commands
+ * @return bool: false if this instance has own commands or shares already
+ */
+bool host_command::share_commands( const host_command& _owner )
+{
+    if ( &_owner == this || ! commands.empty() )
+        return false;
+
+    commands = _owner.commands;
+    shared_commands = true;
+
+    return true;
+}
+
+/** @brief Start to define a new command. Use this for relaxed, step by step definitions
+ *
+ * @param const char*: command name
+ * @return bool: if added OK
+ */
+bool host_command::new_command( const char* _name )
+{
+    if ( shared_commands )
+    {
+        err_code = hc_error_shared_commands;
+        return false;
+    }
+
+    if ( find_command_index( _name ) != -1 )
+    {
+        err_code = hc_error_duplicate_command;
+        return false;
+    }
+
+    if ( static_cast<int>( commands.size() ) >= commands_max )
+    {
+        err_code = hc_error_too_many_commands;
+        return false;
+    }
+
+    host_command_element* cmd = new host_command_element;
+    cmd->name = _name;
+    cmd->optional_start = INT_MAX;
+    cmd->coalesce_key = no_coalescing;
+    cmd->priority = 0;
+    cmd->data_follows = false;
+    cmd->rate.interval = cmd->rate.last = cmd->rate.rejected = 0;
+    cmd->rate.burst = cmd->rate.tokens = 0;
+#if defined(HOST_CMD_STATS)
+    cmd->reported = 0;
+#endif
+    commands.push_back( cmd );
+
+    return true;
+}
+
+/** @brief Continue to define a new command: add new boolean parameter
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ *
+ * @return void
+ */
+void host_command::add_bool_param(void)
+{
+    commands.back()->params.push_back( hcmd_t_bool );
+}
+
+/** @brief Continue to define a new command: add new parameter of a byte type
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ * 
+ * @return void
+ */
+void host_command::add_byte_param(void)
+{
+    commands.back()->params.push_back( hcmd_t_byte );
+}
+
+/** @brief Continue to define a new command: add new int parameter
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ * 
+ * @return void
+ */
+void host_command::add_int_param(void)
+{
+    commands.back()->params.push_back( hcmd_t_int );
+}
+
+/** @brief Continue to define a new command: add new float parameter
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ * 
+ * @return void
+ */
+void host_command::add_float_param(void)
+{
+    commands.back()->params.push_back( hcmd_t_float );
+}
+
+/** @brief Continue to define a new command: add new unquoted string parameter
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ * Error processing: if len is 0 or bigger than buffer length then error code will be set and len will be set to match buffer length - 1.
+ *
+ * @param uint16_t len: maximum length of the string. Default is your buffer length - 1. Max is 65535.
+ * @return void
+ */
+void host_command::add_str_param( uint16_t len = 65535 )
+{
+    if ( len == 0 || len > buf_len - 1 ) //overflow?
+    {
+        err_code = hc_error_bad_length;
+        len = buf_len - 1;
+    }
+
+    commands.back()->params.push_back( hcmd_t_str | len );
+}
+
+/**@brief Continue to define a new command: add new quoted string parameter
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ *
+ * @param uint16_t len: maximum length of the string w/o quotes. Default is your buffer length - 3. Max is 65535.
+ * @return void
+ */
+void host_command::add_qstr_param( uint16_t len = 65535 )
+{
+    if ( len == 0 || len > buf_len - 3 || buf_len < 4 ) //overflow?
+    {
+        err_code = hc_error_bad_length;
+        len = buf_len - 3;
+    }
+
+    commands.back()->params.push_back( hcmd_t_qstr | len );
+}
+
+/**@brief Continue to define a new command: add new hex-encoded binary parameter
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ * The data is decoded on the fly, so the buffer should fit the decoded data only.
+ * Error processing: if len is 0 or bigger than buffer length then error code will be set and len will be set to match buffer length - 1.
+ *
+ * @param uint16_t len: maximum length of the decoded data. Default is your buffer length - 1. Max is 65535.
+ * @return void
+ */
+void host_command::add_hex_param( uint16_t len = 65535 )
+{
+    if ( len == 0 || len > buf_len - 1 ) //overflow?
+    {
+        err_code = hc_error_bad_length;
+        len = buf_len - 1;
+    }
+
+    commands.back()->params.push_back( hcmd_t_blob | hcmd_f_hex | len );
+}
+
+/**@brief Continue to define a new command: add new base64-encoded binary parameter
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ * The data is decoded on the fly, so the buffer should fit the decoded data only.
+ * Error processing: if len is 0 or bigger than buffer length then error code will be set and len will be set to match buffer length - 1.
+ *
+ * @param uint16_t len: maximum length of the decoded data. Default is your buffer length - 1. Max is 65535.
+ * @return void
+ */
+void host_command::add_base64_param( uint16_t len = 65535 )
+{
+    if ( len == 0 || len > buf_len - 1 ) //overflow?
+    {
+        err_code = hc_error_bad_length;
+        len = buf_len - 1;
+    }
+
+    commands.back()->params.push_back( hcmd_t_blob | hcmd_f_base64 | len );
+}
+
+/**@brief Continue to define a new command: add new length-prefixed raw data parameter
+ *
+ * A new_command() should be called before to have a command to add parameters to.
+ * Input format is #length:data, e.g. #5:a b c
+ * The data is copied as is, in bulk, so any bytes, including spaces and EOLs are allowed there.
+ * Error processing: if len is 0 or bigger than buffer length then error code will be set and len will be set to match buffer length - 1.
+ *
+ * @param uint16_t len: maximum length of the data. Default is your buffer length - 1. Max is 65535.
+ * @return void
+ */
+void host_command::add_netstring_param( uint16_t len = 65535 )
+{
+    if ( len == 0 || len > buf_len - 1 ) //overflow?
+    {
+        err_code = hc_error_bad_length;
+        len = buf_len - 1;
+    }
+
+    commands.back()->params.push_back( hcmd_t_blob | hcmd_f_netstring | len );
+}
+
+/**@brief Continue to define a new command: the last added parameter's data will be passed to the sink in chunks
+ *
+ * A new_command() and some add_*_param() should be called before to have a parameter to mark.
+ * The length limit of streamed parameter is lifted. Use set_sink() to receive the data.
+ * Quotes and escapes are processed as usual, so it is safe to split the data at any point.
+ * Error processing: if parameter is not of string, hex or base64 type then error code will be set and nothing changes.
+ *
+ * @return void
+ */
+void host_command::set_streamed(void)
+{
+    if ( commands.size() == 0 || commands.back()->params.size() == 0 )
+        return;
+
+    uint32_t &param = commands.back()->params.back();
+
+    if ( ! (param & (hcmd_t_qstr | hcmd_t_str | hcmd_t_blob)) )
+    {
+        err_code = hc_error_invalid_param_spec;
+        return;
+    }
+
+    param = (param & ~0xffffu) | hcmd_f_stream;
+}
+
+/**@brief Continue to define a new command: inform that the next added parameters will be treated as optional
+ * 
+ * A new_command() should be called before to have a command to add parameters to.
+ * Error processing: if there are no parameters yet or optional parameters were already marked
+ * then no error will be generated and previous state will be unchanged.
+ *
+ * @return void
+ */
+void host_command::optional_from_here(void)
+{
+    if ( commands.size() == 0 )
+        return;
+
+    auto cmd = commands.back();
+
+    if ( cmd->optional_start == INT_MAX )
+        cmd->optional_start = static_cast<int>( cmd->params.size() );
+}
+
+/**@brief Continue to define a new command: let the newer command in backlog supersede the older one
+ *
+ * When several commands of this kind with the same value of the key parameter are waiting in backlog,
+ * only the newest one is reported, in its own place. E.g. the set-point commands flooding faster than they can be
+ * handled. See set_backlog(). The key of -1 means that any newer command of this kind supersedes the older one.
+ * Error processing: if there is no such parameter or it is streamed then error code will be set and nothing changes.
+ *
+ * @param int: key parameter's index or -1
+ * @return void
+ */
+void host_command::coalesce_by( int _key )
+{
+    if ( commands.size() == 0 )
+        return;
+
+    auto cmd = commands.back();
+
+    if ( _key < -1 || _key >= static_cast<int>( cmd->params.size() )
+         || ( _key >= 0 && (cmd->params[ _key ] & hcmd_f_stream) ) )
+    {
+        err_code = hc_error_invalid_param_spec;
+        return;
+    }
+
+    cmd->coalesce_key = _key;
+}
+
+/**@brief Continue to define a new command: set its priority
+ *
+ * Commands of higher priority waiting in backlog are reported before the others, e.g. ESTOP before the telemetry flood.
+ * The commands of the same priority are reported in order of arrival. See set_backlog().
+ *
+ * @param uint8_t: priority. 0 by default
+ * @return void
+ */
+void host_command::set_priority( uint8_t _priority )
+{
+    if ( commands.size() == 0 )
+        return;
+
+    commands.back()->priority = _priority;
+}
+
+/**@brief Continue to define a new command: its line is followed by raw data
+ *
+ * The handler reads the data with fill_buffer() or begin_receive(), so backlog must not take it for the command lines.
+ * No lines are read ahead past such command until it is reported and done with. See set_backlog().
+ *
+ * @return void
+ */
+void host_command::set_data_follows(void)
+{
+    if ( commands.size() == 0 )
+        return;
+
+    commands.back()->data_follows = true;
+}
+
+/**@brief Continue to define a new command: limit its rate
+ *
+ * No more than the number of these commands are reported during the period. They may come at once, but then
+ * the next one is allowed after the period / number time only. The ones over the limit are rejected:
+ * get_next_command() returns false with hc_error_rate_limited error, skipping the command's parameters.
+ *
+ * @param int: number of commands. <= 0 - no limit
+ * @param long: period in milliseconds. <= 0 - no limit
+ * @return void
+ */
+void host_command::set_rate_limit( int _count, long _ms )
+{
+    if ( commands.size() == 0 )
+        return;
+
+    set_bucket( commands.back()->rate, _count, _ms );
+}
+
+/**
+* @brief Internal: tell if the command being parsed from the text input has some parameters yet to come
+*
+* Frames and stored records are in memory already: the unread parameters of them are just skipped.
+*
+* @return bool: true if get_next_command() would lose the rest of command
+*/
+bool host_command::is_unfinished(void) const
+{
+    return cur_cmd > -1 && rec_start < 0 && bl_start < 0 && hold_start < 0 && ! (state & hc_state_frame) && ! is_command_complete();
+}
+
+/**
+* @brief Internal: tell if the text command is to be parsed completely and held until its checksum is verified
+*
+* @return bool: true if so. See set_checksum()
+*/
+bool host_command::is_held(void) const
+{
+    return hold_buf != nullptr && (flags & hc_flag_checksum) && ! (flags & hc_flag_framing);
+}
+
+/**
+* @brief Request to get the next command from the input
+*
+* While the text command is not complete, e.g. the budget of limit_work() ran out in the middle of it,
+* there is no new one: the rest of its parameters is to be taken with has_next_parameter() or dropped with discard().
+*
+* @return bool: false if none or error, or true if new command has arrived
+*/
+bool host_command::get_next_command(void)
+{
+    if ( is_unfinished() ) // the rest of its parameters is for has_next_parameter()
+        return false;
+
+    start_work();
+    check_flow();
+    played = false;
+
+    if ( ! take_next_command() )
+        return false;
+
+    if ( ! played && ! take_rate() ) // the handler is not to be run. the rest of command is skipped
+    {
+        init_for_new_input( hc_state_invalid | ( (state & (hc_state_EOL | hc_state_frame)) ? hc_state_EOL : 0 ) );
+        set_error( hc_error_rate_limited );
+
+        return false;
+    }
+
+#if defined(HOST_CMD_STATS)
+    ++stats.commands;
+    ++commands[cur_cmd]->reported;
+#endif
+
+    if ( trace_buf != nullptr )
+        trace( hc_trace_command, 0 );
+
+    if ( hist != nullptr )
+    {
+        hist_start(); // stored records have no first byte. it is now then
+        hist_cmd = cur_cmd;
+        hist_note( hc_latency_name );
+
+        if ( no_more_parameters() )
+            hist_note( hc_latency_params );
+    }
+
+    return true;
+}
+
+/**
+* @brief Internal: get_next_command() itself, less the budget and counters
+*
+* @return bool: false if none or error, or true if new command has arrived
+*/
+bool host_command::take_next_command(void)
+{
+
+    if ( rec_start < 0 && hold_start < 0 ) // not in the middle of capturing the command into the batch
+    {
+        if ( seq >= 0 && ( (state & hc_state_invalid) || ( cur_cmd > -1 && is_command_complete() ) ) )
+            acknowledge();
+
+        if ( cur_cmd > -1 && is_command_complete() ) // leave the partially received command name or frame alone
+            discard();
+
+        if ( bl_line != nullptr && ! (flags & hc_flag_framing) )
+        {
+            int rc = backlog_next();
+
+            if ( rc >= 0 )
+                return rc > 0;
+        }
+    }
+
+    for(;;)
+    {
+        if ( rec_start < 0 && hold_start < 0 )
+        {
+            if ( play_left > 0 ) // committed batch goes first
+                return next_record() > 0;
+
+            if ( cache != nullptr && in_left == 0 && state == hc_state_clean && ! batch_open && ! (flags & hc_flag_framing) )
+            {
+                int rc = cache_lookup();
+
+                if ( rc >= 0 ) // hit or need more data
+                    return rc > 0;
+            }
+
+            int rc = check_input();
+
+            if ( rc <= 0 )
+            {
+                if ( play_left > 0 ) // got COMMIT just now
+                    continue;
+
+                if ( rc < 0 && batch_open && batch_err == 0 ) // e.g. unknown command. the batch is spoiled
+                    batch_err = err_code;
+
+                return false;
+            }
+
+            if ( cache_fill >= 0 ) // line is not in cache yet. maybe it will be
+                cache_put( true );
+
+            if ( ! batch_open && ! is_held() )
+                return true;
+        }
+
+        if ( ! batch_open ) // held until the checksum is verified on EOL, then reported from the storage
+        {
+            cache_fill = -1;
+
+            swap_records( hold_buf, hold_size, hold_used, hold_start );
+            int rc = capture( hc_error_param_too_long );
+            swap_records( hold_buf, hold_size, hold_used, hold_start );
+
+            if ( rc == 0 ) // the rest of command is not here yet
+                return false;
+
+            if ( rc < 0 )
+            {
+                if ( rc == -2 )
+                    hc_stat( overflows++ );
+
+                return false;
+            }
+
+            play_ptr = hold_buf;
+            play_left = hold_used;
+            hold_used = 0;
+            rc = next_record();
+            played = false; // it is limited as any other
+
+            return rc > 0;
+        }
+
+        int rc = capture( hc_error_bad_batch );
+
+        if ( rc == 0 ) // the rest of command is not here yet
+            return false;
+
+        if ( rc < 0 && batch_err == 0 )
+            batch_err = err_code;
+        if ( seq >= 0 )
+            acknowledge();
+
+        discard(); // done with it. skip the rest of line if any
+    }
+}
+
+/**
+* @brief Return currently processed command's index
+*
+* @return int: -1 if none or index of new command available
+*/
+int host_command::get_command_id(void)
+{
+    return cur_cmd;
+}
+
+/**
+* @brief Return the name of the command being currently processed
+*
+* @return const char*: empty if no current command 
+*/
+const char*host_command::get_command_name(void)
+{
+    if ( cur_cmd == -1 )
+        return "";
+
+    return commands[cur_cmd]->name;
+}
+
+/**
+* @brief Check if current command processing is invalidated
+*
+* @return bool: true if something got broken
+*/
+bool host_command::is_invalid_input(void) const
+{
+    return state & hc_state_invalid;
+}
+
+/**
+* @brief Check if current command processing is formally done
+*
+* Note that return valuee here depends not only on error, no command,
+* or command with EOL received, but also
+*     1) if current parameter is optional
+*     2) or if current parameter is the last by definition and received complete
+*
+* @return bool: true if complete
+*/
+bool host_command::is_command_complete(void) const
+{
+    if( cur_cmd == -1 || ( state & (hc_state_EOL | hc_state_invalid) ) )
+        return true;
+
+    if ( (flags & hc_flag_checksum) && ! (state & hc_state_frame) ) // nothing is complete until the checksum is verified
+        return false;
+
+    if( is_optional() || commands[cur_cmd]->params.size() == 0 )
+        return true;
+
+    // if it is the last parameter and is already complete?
+    return ( state & hc_state_complete ) &&
+           ( cur_param + 1 == static_cast<int>( commands[cur_cmd]->params.size() ) );
+}
+
+/**
+* @brief Requests to get the next parameter from the input
+*
+* @return int: false if none/error or true if new parameter's data is available
+*/
+bool host_command::has_next_parameter(void)
+{
+    if ( no_more_parameters() )
+        return false;
+
+    start_work();
+    check_flow();
+
+    int rc = check_input();
+
+    if ( cache_fill >= 0 )
+        cache_put( rc > 0 );
+
+    if ( rc > 0 )
+    {
+        hc_stat( params++ );
+
+        if ( trace_buf != nullptr )
+            trace( hc_trace_param, 0 );
+    }
+
+    if ( hist_cmd >= 0 && ! (state & hc_state_invalid) && no_more_parameters() )
+        hist_note( hc_latency_params );
+
+    return rc > 0;
+}
+
+/**
+* @brief Return current parameter's index
+*
+* @return int: -1 if none or index of new parameter available
+*/
+int host_command::get_parameter_index(void)
+{
+    if ( cur_cmd == -1 )
+        return -1;
+
+    return cur_param;
+}
+
+/**
+ * @brief return the value of the current parameter to be extracted.
+ *
+ * @return uint32_t info bitmask or 0 if something wrong
+ */
+uint32_t host_command::get_parameter_info(void)
+{
+    if ( cur_cmd == -1 || cur_param == -1 )
+        return 0;
+
+    return commands[cur_cmd]->params[cur_param];
+}
+
+/**
+ * @brief return true if current parameter is optional.
+ *
+ * @return bool
+ */
+bool host_command::is_optional(void) const
+{
+    if( cur_cmd == -1 || cur_param == -1 )
+        return false;
+    
+    return cur_param >= commands[cur_cmd]->optional_start;
+}
+
+/**
+ * @brief return true if all possible parameters were received, including optional ones
+ *
+ * @return bool
+ */
+bool host_command::no_more_parameters(void) const
+{
+    if( cur_cmd == -1 || state & ( hc_state_EOL | hc_state_invalid ) )
+        return true;
+
+    if ( (flags & hc_flag_checksum) && ! (state & hc_state_frame) ) // nothing is complete until the checksum is verified
+        return false;
+
+    if ( commands[cur_cmd]->params.size() == 0 )
+        return true;
+
+    // if it is the last parameter and is already complete?
+    return ( state & hc_state_complete ) && 
+           ( cur_param + 1 == static_cast<int>( commands[cur_cmd]->params.size() ) );
+} 
+
+/**
+* @brief Discard the current input and force wait for a new command to arrive if needed
+*
+* @return void
+*/
+void host_command::discard(void)
+{
+    if (state == hc_state_clean || state & (hc_state_EOL | hc_state_frame))
+        init_for_new_input( hc_state_clean ); // Clean or already got EOL. Just marking as clean
+    else
+        init_for_new_input( hc_state_invalid ); // Will wait for EOL
+}
+
+/**
+ * @brief Internal: Check if there is new command/parameter available to process
+ * 
+ * To have a low-memory footprint we'll store and scan one parameter at the time maximum.
+ *
+ * @return int: -1 on error, 0 if no new data arrived yet, 1 if some
+ */
+int host_command::check_input(void)
+{
+    // checking for previous act's completion and moving forward if necessary
+    if ( cur_cmd > -1 && (state & hc_state_complete) ) // have previous parameter complete
+    {
+        // if got all params already and we're in the complete state, then init for next command
+        if ( cur_param + 1 == static_cast<int>( commands[ cur_cmd ]->params.size() ) ) // no params or last one
+        {
+            if ( (flags & hc_flag_checksum) && ! (state & (hc_state_EOL | hc_state_frame)) ) // not over until the checksum is verified
+                state |= hc_state_tail;
+            else
+                init_for_new_input( hc_state_clean );
+        }
+
+        else // we'll wait for the next parameter then
+        {
+            cur_param++;
+            state = hc_state_param | (state & hc_state_frame); // we need to reset previous parameter state completely
+            buf_pos = 0;
+            streamed_len = 0;
+            dec_acc = 0;
+            dec_bits = 0;
+        }
+    }
+
+    if ( state & hc_state_EOL ) // maybe got a command with no params or EOL on optional params
+    {
+        init_for_new_input( hc_state_clean );
+    }
+
+    if ( state & hc_state_frame ) // all the data is here already
+        return next_field();
+
+    if ( flags & hc_flag_framing )
+        return read_frame();
+
+    host_command_deadline till;
+    uint8_t polls = 0;
+
+    set_deadline( till, ms_to_ticks( max_time ) );
+
+    for(;;) // we'll loop while there is still some data in the stream... or time is out
+    {
+        if ( till.span > 0 && ++polls == work_clock_every ) // timeout is set - checking once in a while
+        {
+            polls = 0;
+
+            if ( is_past( till ) )
+            {
+                hc_stat( timeouts++ );
+
+                if ( trace_buf != nullptr )
+                    trace( hc_trace_timeout, 0 );
+
+                return -1;
+            }
+        }
+
+        int c = input_available();
+
+        if ( c < 0 ) // some error
+            return -1;
+        
+        if ( c == 0 ) // nothing yet
+            return 0;
+
+        if ( buf_pos == buf_len ) // overflow. discarding command
+        {
+            if ( (state & hc_state_param) && (commands[ cur_cmd ]->params[ cur_param ] & hcmd_f_stream) )
+            {
+                flush_to_sink( false ); // streamed parameter. just pass the chunk further
+                continue;
+            }
+
+            if (flags & hc_flag_interactive)
+            {
+                source->println("\n? Too long input. Will be discarded till EOL.");
 
                 if (prompt != nullptr)
                     source->print(prompt);
             }
 
-            discard();
-            
-            err_code = hc_error_param_too_long;
+            discard();
+            hc_stat( overflows++ );
+            set_error( hc_error_param_too_long );
+
+            return -1;
+        }
+
+        if ( state & hc_state_payload ) // length-prefixed data. no scanning, just copy as much as we can
+        {
+            c = spend_work( c );
+
+            if ( c == 0 ) // enough for this call
+                return 0;
+
+            int rc = read_payload( c );
+
+            if ( rc != 0 )
+                return rc;
+
+            continue;
+        }
+
+        if ( spend_work( 1 ) == 0 ) // enough for this call
+            return 0;
+
+        c = input_read();
+
+        if ( c < 0 ) // error?
+            return -1;
+
+        if ( separator != '\0' && c == static_cast<uint8_t>( separator ) && ! (state & (hc_state_escape | hc_state_got_quotes)) )
+            c = '\n'; // commands separator works just like EOL
+
+        if( state & hc_state_invalid ) // waiting for invalidated input to be ended with LF
+        {
+            if ( c == '\n' || c == '\r' )
+                init_for_new_input( hc_state_clean );
+
+            continue;
+        }
+
+        if ( flags & hc_flag_checksum )
+        {
+            int rc = checksum_char( c );
+
+            if ( rc < 0 )
+            {
+                if ( flags & hc_flag_interactive )
+                {
+                    source->println( "\nBad checksum." );
+
+                    if ( prompt != nullptr )
+                        source->print( prompt );
+                }
+
+                set_error( hc_error_bad_checksum );
+                state |= hc_state_invalid;
+
+                if ( c == '\n' || c == '\r' )
+                    state |= hc_state_EOL;
+
+                return -1;
+            }
+
+            if ( rc > 0 ) // it was the checksum's part
+                continue;
+
+            if ( state & hc_state_tail ) // extra parameters are dropped till the verified EOL
+            {
+                if ( c != '\n' && c != '\r' )
+                    continue;
+
+                state |= hc_state_EOL;
+
+                return 0;
+            }
+        }
+
+        if ( state & hc_state_escape ) // this char is escaped
+        {
+            state &= ~hc_state_escape;
+
+            buf[ buf_pos++ ] = c;
+
+            continue;
+        }
+
+        if ( (state & hc_state_delim) && c != '\n' && c != '\r' && c != ' ' && c != '\t' ) // data runs into the next token
+        {
+            set_error( hc_error_bad_prefix );
+            state |= hc_state_invalid;
+
+            return -1;
+        }
+
+		// always drop leading spaces in simple cases, but not in quoted strings (if we got some already)
+        if ( buf_pos == 0 && streamed_len == 0 && c != '\n' && c != '\r' && !(state & (hc_state_got_quotes | hc_state_count | hc_state_seq | hc_state_delim))
+             && isspace(c))
+        {
+            continue;
+        }
+
+        if ( c == '\n' || c == '\r' || c == ' ' || c == '\t' ) // checking for EOL or end of cmd/param
+        {
+            if ( state & hc_state_seq ) // tag is done. the command name follows
+            {
+                state &= ~hc_state_seq;
+
+                if ( c == '\n' || c == '\r' ) // but there is none
+                {
+                    set_error( hc_error_unknown_command );
+                    state |= hc_state_invalid | hc_state_EOL;
+
+                    return -1;
+                }
+
+                continue;
+            }
+
+            if ( ! (state & hc_state_got_some) && ( c == '\n' || c == '\r' ) ) // skipping empty lines quick
+            {
+                if ( flags & hc_flag_checksum ) // spaces or lone "*hh" are not to be summed with the next line
+                    reset_checksum();
+
+                continue;
+            }
+
+            if ( state & hc_state_cmd ) // command name
+            {
+                //if (buf_pos == 0)
+                //{
+                //    init_for_new_input(hc_state_clean);
+                //    continue;
+                //}
+
+                if ( c == '\n' || c == '\r' )
+                    state |= hc_state_EOL;
+
+                state |= hc_state_complete;
+
+                buf[ buf_pos ] = '\0';
+
+                break; // exit loop to validate command name
+            }
+
+            // we have parameter here
+
+            host_command_element *cmd = commands[ cur_cmd ];
+
+            // any space is valid in quoted string (if we're not over the limit though)
+            if ( cmd->params[ cur_param ] & hcmd_t_qstr && ! ( state & hc_state_skip ) )
+            {
+                buf[ buf_pos++ ] = c;
+
+                continue;
+            }
+
+            if ( c == '\n' || c == '\r' )
+            {
+                state |= hc_state_EOL;
+
+                if ( (state & hc_state_sum) && buf_pos == 0 && streamed_len == 0 && ! (state & hc_state_delim) && is_optional() ) // "cmd 1 *hh"
+                    return 0;
+
+                // checking if this or next param is not optional
+                if ( ( buf_pos == 0 && streamed_len == 0 && ! (state & hc_state_delim) ) ||
+                     ( cur_param + 1 < static_cast<int>(cmd->params.size()) &&
+                       cur_param + 1 < cmd->optional_start ) )
+                {
+                    if ( flags & hc_flag_interactive )
+                    {
+                        source->print( "\nAttempt to skip non-optional parameter #" );
+                        source->println( cur_param + 1 );
+
+                        if ( prompt != nullptr )
+                            source->print( prompt );
+                    }
+
+                    set_error( hc_error_required_missing );
+
+                    state |= hc_state_invalid;
+
+                    return -1;
+                }
+            } // if EOL
+
+            return finish_parameter(); // got another complete parameter
+        } // got EOL or space
+
+        if ( state & hc_state_skip ) // we need to skip till this param end
+            continue;
+
+        // binary data is decoded right here, so no escapes or length checks below are needed
+        if ( (state & hc_state_param) && (commands[ cur_cmd ]->params[ cur_param ] & hcmd_t_blob) )
+        {
+            if ( commands[ cur_cmd ]->params[ cur_param ] & hcmd_f_netstring )
+            {
+                if ( prefix_char( c ) )
+                {
+                    if ( (state & hc_state_payload) && payload_left == 0 ) // empty one
+                        state = (state & ~hc_state_payload) | hc_state_delim;
+
+                    continue;
+                }
+            }
+
+            else if ( decode_char( c ) )
+                continue;
+
+            if ( flags & hc_flag_interactive )
+            {
+                source->print( "\nBad parameter's data: " );
+                source->println( errstr() );
+
+                if ( prompt != nullptr )
+                    source->print( prompt );
+            }
+
+            state |= hc_state_invalid;
+
+            return -1;
+        }
+
+        if ( (flags & hc_flag_escapes) && c == '\\' )
+        {
+            state |= hc_state_escape;
+
+            continue;
+        }
+
+        if ( state & hc_state_seq ) // sequence number's digits
+        {
+            if ( c < '0' || c > '9' || seq > sequence_max / 10 )
+            {
+                seq = -1; // can't tell the host which one is broken anyway
+                state |= hc_state_invalid;
+
+                return -1;
+            }
+
+            seq = seq * 10 + (c - '0');
+
+            continue;
+        }
+
+        if ( state == hc_state_clean ) // the first byte of command
+        {
+            hist_start();
+
+            if ( trace_buf != nullptr )
+                trace( hc_trace_start, static_cast<uint8_t>( c ) );
+        }
+
+        if ( state == hc_state_clean && c == sequence_tag && (flags & hc_flag_sequence) )
+        {
+            seq = 0;
+            state |= hc_state_seq;
+
+            continue;
+        }
+
+        if ( state == hc_state_clean || state & hc_state_cmd ) // still waiting for a command name to complete
+        {
+            buf[ buf_pos++ ] = c;
+            state |= hc_state_cmd;
+
+            continue;
+        }
+
+        // we wait for parameter here:
+
+        host_command_element *cmd = commands[ cur_cmd ];
+
+        // checking if our parameter is within user-requested size
+        // NOTE: (now) this is used for strings only. Streamed ones have the length of previous chunks accounted
+        if ( cmd->params[cur_param] & 0xffff
+             && ( static_cast<int>( cmd->params[cur_param] & 0xffff ) == streamed_len + buf_pos ) )
+        {
+            state |= hc_state_skip;
+            buf[ buf_pos ] = '\0';
+            continue;
+        }
+
+        // Quoted strings
+        if ( cmd->params[ cur_param ] & hcmd_t_qstr )
+        {
+            if (c == '"' || c == '\'') // check for the beginning/ending quote
+            {
+                if ( ! (state & hc_state_got_quotes) ) // is it the opening quote?
+                {
+                    // remember what type of quote used at the beginning
+                    if (c == '"')
+                        state |= hc_state_d_quote;
+                    else
+                        state |= hc_state_s_quote;
+
+                    continue; // don't store quotes
+                }
+
+                else if ( (c == '"' && (state & hc_state_d_quote)) // matching closing quote?
+                    || (c == '\'' && (state & hc_state_s_quote)) )
+                {
+                    return finish_parameter();
+                }
+            } // got quote
+
+            // if 1st char is not a quote then set error state
+            else if ( buf_pos == 0 && ! (state & hc_state_got_quotes))
+            {
+                set_error( hc_error_missing_quotes );
+
+                state |= hc_state_invalid;
+                
+                return -1;
+            }
+        } // if quoted string?
+
+        //TODO: check if no quotes was used
+        //TODO: check for maximum string length
+
+        buf[ buf_pos++ ] = c;
+
+    } //for() loop over all available data in stream
+
+    // checking if we know this command
+    cur_cmd = find_command_index((const char*)buf);
+
+    if ( cur_cmd == -1 && (flags & hc_flag_batches) ) // maybe it's a batch control word
+    {
+        int rc = batch_marker();
+
+        if ( rc != 1 )
+            return rc;
+    }
+
+    if ( cur_cmd == -1 )
+    {
+        if (flags & hc_flag_interactive)
+        {
+            source->println("\nUnknown command.");
+
+            if (prompt != nullptr)
+                source->print(prompt);
+        }
+
+        init_for_new_input( hc_state_invalid | (state & hc_state_EOL) ); // skip the parameters if there are any
+        set_error( hc_error_unknown_command );
+
+        return -1;
+    }
+
+    return 1;
+} // int check
+
+/**
+* @brief Internal: send ACK or NAK for the sequence-tagged command, depending on its state
+*/
+void host_command::acknowledge(void)
+{
+    reply( seq, (state & hc_state_invalid) ? err_code : hc_error_no_error );
+    seq = -1;
+}
+
+/**
+* @brief Internal: send ACK or NAK for the sequence number
+*
+* @param long - sequence number
+* @param int - error code or hc_error_no_error for ACK
+*/
+void host_command::reply( long _seq, int _err )
+{
+    if ( _err != hc_error_no_error )
+    {
+        source->print( "NAK " );
+        source->print( _seq );
+        source->print( " " );
+        source->println( _err );
+    }
+
+    else
+    {
+        source->print( "ACK " );
+        source->println( _seq );
+    }
+}
+
+/**
+* @brief Internal: add the next char of text line to the checksum or take it as the checksum's digit
+*
+* The '*' is taken as the start of the checksum if it is not escaped and not inside of quoted string.
+* On EOL the checksum is verified.
+*
+* @param int - input char
+* @return int: -1 on bad or mismatched checksum, 1 if char is the checksum's part, 0 if char is for the parser
+*/
+int host_command::checksum_char( int c )
+{
+    bool crc = flags & hc_flag_crc16;
+
+    if ( ( c == '\n' || c == '\r' ) && ! (state & hc_state_escape) )
+    {
+        if ( state == hc_state_clean ) // empty line
+            return 0;
+
+        if ( ! (state & hc_state_sum) || sum_digits != ( crc ? 4 : 2 ) || sum_got != line_sum )
+            return -1;
+
+        return 0;
+    }
+
+    if ( state & hc_state_sum )
+    {
+        if ( c >= '0' && c <= '9' )
+            c -= '0';
+        else if ( (c | 0x20) >= 'a' && (c | 0x20) <= 'f' )
+            c = (c | 0x20) - 'a' + 10;
+        else
+            return -1;
+
+        if ( ++sum_digits > ( crc ? 4 : 2 ) )
+            return -1;
+
+        sum_got = static_cast<uint16_t>( (sum_got << 4) | c );
+
+        return 1;
+    }
+
+    if ( c == '*' && ! (state & (hc_state_escape | hc_state_got_quotes | hc_state_payload)) )
+    {
+        state |= hc_state_sum;
+
+        return 1;
+    }
+
+    sum_byte( static_cast<uint8_t>( c ) );
+
+    return 0;
+}
+
+/**
+* @brief Internal: add the byte to the line's checksum with no special meaning of any char. Used for raw data
+*
+* @param uint8_t - data byte
+*/
+void host_command::sum_byte( uint8_t c )
+{
+    if ( flags & hc_flag_crc16 )
+        line_sum = static_cast<uint16_t>( (line_sum << 8) ^ hc_crc16_table[ ((line_sum >> 8) ^ c) & 0xFF ] );
+    else
+        line_sum ^= c;
+}
+
+/**
+* @brief Internal: forget the checksum of the previous line
+*/
+void host_command::reset_checksum(void)
+{
+    state &= ~hc_state_sum;
+    line_sum = ( flags & hc_flag_crc16 ) ? 0xFFFF : 0;
+    sum_got = 0;
+    sum_digits = 0;
+}
+
+/**
+* @brief Internal: decode the next char of hex or base64 parameter right into the buffer
+*
+* Sets err_code on error.
+*
+* @param int - input char
+* @return bool: false if char is invalid or decoded data is too long
+*/
+bool host_command::decode_char( int c )
+{
+    uint32_t param = commands[ cur_cmd ]->params[ cur_param ];
+
+    if ( param & hcmd_f_hex )
+    {
+        if ( c >= '0' && c <= '9' )
+            c -= '0';
+        else if ( (c | 0x20) >= 'a' && (c | 0x20) <= 'f' )
+            c = (c | 0x20) - 'a' + 10;
+        else
+        {
+            set_error( hc_error_bad_encoding );
+            return false;
+        }
+
+        dec_acc = (dec_acc << 4) | c;
+        dec_bits += 4;
+    }
+
+    else // base64
+    {
+        if ( c == '=' )
+        {
+            if ( dec_bits != 2 && dec_bits != 4 && ! (state & hc_state_pad) ) // padding is allowed at the end of quad only
+            {
+                set_error( hc_error_bad_encoding );
+                return false;
+            }
+
+            state |= hc_state_pad;
+            return true;
+        }
+
+        int8_t v = hc_base64_values[ c & 0xff ];
+
+        if ( v < 0 || (state & hc_state_pad) )
+        {
+            set_error( hc_error_bad_encoding );
+            return false;
+        }
+
+        dec_acc = (dec_acc << 6) | v;
+        dec_bits += 6;
+    }
+
+    if ( dec_bits < 8 ) // no full byte yet
+        return true;
+
+    dec_bits -= 8;
+
+    // checking if our data is within user-requested size. zero is for unlimited streamed data
+    if ( (param & 0xffff) && streamed_len + buf_pos >= static_cast<int>( param & 0xffff ) )
+    {
+        set_error( hc_error_param_too_long );
+        return false;
+    }
+
+    buf[ buf_pos++ ] = static_cast<uint8_t>( dec_acc >> dec_bits );
+    dec_acc &= (1u << dec_bits) - 1;
+
+    return true;
+}
+
+/**
+* @brief Internal: process the next char of #length: prefix of length-prefixed parameter
+*
+* Sets err_code on error.
+*
+* @param int - input char
+* @return bool: false if char is invalid
+*/
+bool host_command::prefix_char( int c )
+{
+    if ( ! (state & hc_state_count) ) // should start with '#'
+    {
+        if ( c != '#' )
+        {
+            set_error( hc_error_bad_prefix );
+            return false;
+        }
+
+        state |= hc_state_count;
+        payload_left = 0;
+        return true;
+    }
+
+    if ( isdigit( c ) )
+    {
+        if ( payload_left > 0x7fffffffL / 10 - 1 ) // no overflows please
+        {
+            set_error( hc_error_bad_prefix );
+            return false;
+        }
+
+        payload_left = payload_left * 10 + c - '0';
+        dec_bits = 1; // no decoding for this type, so used as "got some digits" mark
+        return true;
+    }
+
+    if ( c != ':' || dec_bits == 0 )
+    {
+        set_error( hc_error_bad_prefix );
+        return false;
+    }
+
+    dec_bits = 0;
+    state = (state & ~hc_state_count) | hc_state_payload;
+
+    uint32_t limit = commands[ cur_cmd ]->params[ cur_param ] & 0xffff;
+
+    if ( limit && payload_left > static_cast<long>( limit ) ) // too long. will drop it, but keep in sync with input
+        state |= hc_state_skip;
+
+    return true;
+}
+
+/**
+* @brief Internal: copy the available part of length-prefixed data into the buffer
+*
+* @param int - number of bytes available from source
+* @return int: 0 if more data or the delimiter after it is expected, -1 on error
+*/
+int host_command::read_payload( int avail )
+{
+    long count = avail;
+
+    if ( count > payload_left )
+        count = payload_left;
+
+    if ( state & hc_state_skip ) // just drop it
+    {
+        if ( count > buf_len )
+            count = buf_len;
+
+        count = static_cast<long>( input_read_bytes( buf, static_cast<int>( count ) ) );
+    }
+
+    else
+    {
+        if ( count > buf_len - buf_pos )
+            count = buf_len - buf_pos;
+
+        count = static_cast<long>( input_read_bytes( buf + buf_pos, static_cast<int>( count ) ) );
+        buf_pos += static_cast<int>( count );
+    }
+
+    if ( count <= 0 ) // source changed its mind
+        return 0;
+
+    if ( flags & hc_flag_checksum ) // raw data counts too
+    {
+        const uint8_t* data = ( state & hc_state_skip ) ? buf : buf + buf_pos - count;
+
+        for ( long i = 0; i < count; ++i )
+            sum_byte( data[i] ); // CR and LF are data here
+    }
+
+    payload_left -= count;
+
+    if ( payload_left > 0 )
+        return 0;
+
+    if ( state & hc_state_skip )
+    {
+        set_error( hc_error_param_too_long );
+        state |= hc_state_invalid;
+
+        return -1;
+    }
+
+    state = (state & ~hc_state_payload) | hc_state_delim; // the parameter ends with the delimiter after it
+
+    return 0;
+}
+
+/**
+* @brief Internal: complete the parameter: check for hex/base64 leftovers and flush the streamed data
+*
+* @return int: 1 if complete nicely, -1 on error
+*/
+int host_command::finish_parameter(void)
+{
+    uint32_t param = commands[ cur_cmd ]->params[ cur_param ];
+
+    // length-prefixed data should have the data complete, not broken by space or EOL
+    if ( (param & hcmd_f_netstring) && ! (state & hc_state_delim) )
+    {
+        set_error( hc_error_bad_prefix );
+        state |= hc_state_invalid;
+
+        return -1;
+    }
+
+    // hex should have even number of digits and base64 can't have a lone char in the last quad
+    if ( ( (param & hcmd_f_hex) && dec_bits != 0 ) || dec_bits == 6 )
+    {
+        set_error( hc_error_bad_encoding );
+        state |= hc_state_invalid;
+
+        return -1;
+    }
+
+    if ( param & hcmd_f_stream )
+        flush_to_sink( true );
+
+    state = (state & ~hc_state_delim) | hc_state_complete;
+
+    buf[ buf_pos ] = '\0';
+
+    return 1;
+}
+
+/**
+* @brief Internal: pass the buffer's contents to the sink and make it empty
+*
+* @param bool - true if this is the last chunk of the parameter
+*/
+void host_command::flush_to_sink( bool last )
+{
+    if ( sink != nullptr )
+        sink( this, buf, buf_pos, last );
+
+    streamed_len += buf_pos;
+    buf_pos = 0;
+}
+
+/**
+* @brief Internal: read the binary frame from the source. Non-blocking: continues the partial frame on the next call.
+*
+* Frame's contents are: command index byte and then parameters' fields, in order, as defined by new_command():
+*   bool, byte - 1 byte
+*   int, float - 4 bytes, little-endian. float is IEEE 754 single precision
+*   strings - chars and terminating zero
+*   binary types - 2 bytes of little-endian length and the data
+* Trailing optional parameters may be omitted.
+*
+* @return int: -1 on error, 0 if frame is incomplete yet, 1 if new command is here
+*/
+int host_command::read_frame(void)
+{
+    host_command_deadline till;
+    uint8_t polls = 0;
+
+    set_deadline( till, ms_to_ticks( max_time ) );
+
+    for(;;) // the same time limit as for text lines
+    {
+        if ( till.span > 0 && ++polls == work_clock_every )
+        {
+            polls = 0;
+
+            if ( is_past( till ) )
+            {
+                hc_stat( timeouts++ );
+
+                if ( trace_buf != nullptr )
+                    trace( hc_trace_timeout, 0 );
+
+                return -1;
+            }
+        }
+
+        int c = source->available();
+
+        if ( c < 0 ) // some error
+            return -1;
+
+        if ( c == 0 ) // nothing yet
+            return 0;
+
+        if ( spend_work( 1 ) == 0 ) // enough for this call
+            return 0;
+
+        c = source->read();
+        hc_stat( bytes++ );
+
+        if ( c < 0 ) // error?
+            return -1;
+
+        if ( flags & hc_flag_slip )
+        {
+            if ( c == slip_end )
+            {
+                if ( state & hc_state_escape ) // broken escape sequence
+                    state |= hc_state_skip;
+
+                int rc = start_frame();
+
+                if ( rc != 0 )
+                    return rc;
+
+                continue;
+            }
+
+            if ( state & hc_state_escape )
+            {
+                state &= ~hc_state_escape;
+
+                if ( c == slip_esc_end )
+                    c = slip_end;
+                else if ( c == slip_esc_esc )
+                    c = slip_esc;
+                else
+                    state |= hc_state_skip;
+            }
+
+            else if ( c == slip_esc )
+            {
+                state |= hc_state_escape;
+                continue;
+            }
+        }
+
+        else // COBS
+        {
+            if ( c == 0 )
+            {
+                if ( cobs_left != 0 ) // frame is cut short
+                    state |= hc_state_skip;
+
+                int rc = start_frame();
+
+                if ( rc != 0 )
+                    return rc;
+
+                continue;
+            }
+
+            if ( cobs_left == 0 ) // got the next code byte
+            {
+                bool first = ! (state & hc_state_cmd);
+
+                if ( first )
+                {
+                    hist_start();
+
+                    if ( trace_buf != nullptr )
+                        trace( hc_trace_start, c );
+                }
+
+                state |= hc_state_cmd;
+                cobs_left = c - 1;
+
+                uint8_t prev_code = cobs_code;
+                cobs_code = c;
+
+                if ( first || prev_code == 0xFF ) // there is no zero before the first block or after the full one
+                    continue;
+
+                c = 0;
+            }
+
+            else
+                --cobs_left;
+        }
+
+        if ( ! (state & hc_state_cmd) )
+        {
+            hist_start();
+
+            if ( trace_buf != nullptr )
+                trace( hc_trace_start, c );
+        }
+
+        state |= hc_state_cmd;
+
+        if ( buf_pos == buf_len ) // frame is too long. drop it
+        {
+            hc_stat( overflows++ );
+            set_error( hc_error_param_too_long );
+            state |= hc_state_skip;
+            continue;
+        }
+
+        buf[ buf_pos++ ] = c;
+    }
+}
+
+/**
+* @brief Internal: start processing of the frame just received
+*
+* @return int: -1 on error, 0 if frame is empty, 1 if new command is here
+*/
+int host_command::start_frame(void)
+{
+    cobs_left = cobs_code = 0;
+
+    if ( state & hc_state_skip ) // dropped
+    {
+        if ( err_code != hc_error_param_too_long )
+            set_error( hc_error_bad_frame );
+
+        int err = err_code;
+        init_for_new_input( hc_state_invalid | hc_state_EOL );
+        err_code = err;
+
+        return -1;
+    }
+
+    if ( buf_pos == 0 ) // empty one. may be used to sync with the other side
+    {
+        init_for_new_input( hc_state_clean );
+        return 0;
+    }
+
+    frame = buf;
+    frame_len = buf_pos;
+
+    return open_frame();
+}
+
+/**
+* @brief Internal: start processing of the binary frame or stored record: take the command index from it
+*
+* @return int: -1 on error, 1 if new command is here
+*/
+int host_command::open_frame(void)
+{
+    frame_pos = 1;
+    cur_cmd = frame[0];
+    cur_param = -1;
+
+    if ( cur_cmd >= static_cast<int>( commands.size() ) )
+    {
+        init_for_new_input( hc_state_invalid | hc_state_EOL );
+        set_error( hc_error_unknown_command );
+
+        return -1;
+    }
+
+    host_command_element *cmd = commands[ cur_cmd ];
+    int pos = frame_pos;
+
+    for ( size_t i = 0; i < cmd->params.size() && pos < frame_len; ++i ) // bytes past the last field are not allowed
+    {
+        const uint8_t* data;
+        int len;
+        int size = field_size( cmd->params[i], frame + pos, frame_len - pos, &data, &len );
+
+        if ( size < 0 ) // broken field is reported by next_field() in its turn
+            break;
+
+        pos += size;
+
+        if ( i + 1 == cmd->params.size() && pos < frame_len )
+        {
+            init_for_new_input( hc_state_invalid | hc_state_EOL );
+            set_error( hc_error_bad_frame );
+
+            return -1;
+        }
+    }
+
+    if ( cmd->params.size() == 0 && frame_len > frame_pos )
+    {
+        init_for_new_input( hc_state_invalid | hc_state_EOL );
+        set_error( hc_error_bad_frame );
+
+        return -1;
+    }
+
+    state = hc_state_cmd | hc_state_complete | hc_state_frame;
+
+    if ( frame_pos == frame_len && cmd->optional_start == 0 )
+        state |= hc_state_EOL;
+
+    return 1;
+}
+
+/**
+* @brief Internal: get the next parameter's field from the binary frame
+*
+* @return int: -1 on error, 0 if no more fields, 1 if the next parameter is available
+*/
+int host_command::next_field(void)
+{
+    host_command_element *cmd = commands[ cur_cmd ];
+    uint32_t param = cmd->params[ cur_param ];
+
+    if ( frame_pos >= frame_len ) // no more data
+    {
+        if ( cur_param < cmd->optional_start )
+        {
+            set_error( hc_error_required_missing );
+            state |= hc_state_invalid | hc_state_EOL;
+            return -1;
+        }
+
+        state |= hc_state_EOL;
+        return 0;
+    }
+
+    int size = field_size( param, frame + frame_pos, frame_len - frame_pos, &field, &field_len );
+
+    if ( size < 0 )
+    {
+        set_error( hc_error_bad_frame );
+        state |= hc_state_invalid | hc_state_EOL;
+        return -1;
+    }
+
+    if ( (param & 0xffff) && field_len > static_cast<int>( param & 0xffff ) )
+    {
+        set_error( hc_error_param_too_long );
+        state |= hc_state_invalid | hc_state_EOL;
+        return -1;
+    }
+
+    frame_pos += size;
+
+    if ( (param & hcmd_f_stream) && sink != nullptr ) // it's all here, so pass it in one go
+        sink( this, field, field_len, true );
+
+    state |= hc_state_complete;
+
+    if ( frame_pos == frame_len && cur_param + 1 >= cmd->optional_start ) // otherwise next call will report the missing one
+        state |= hc_state_EOL;
+
+    return 1;
+}
+
+/**
+* @brief Internal: handle the batch control word that is in the buffer now
+*
+* @return int: 1 if it is not a control word, 0 if processed, -1 on error
+*/
+int host_command::batch_marker(void)
+{
+    const char* word = (const char*)buf;
+
+    if ( same_strings( word, batch_begin ) ) // a new one drops the unfinished one
+    {
+        if ( batch_open )
+            settle_records( rec_buf, rec_used, hc_error_bad_batch );
+
+        batch_open = true;
+        batch_err = 0;
+        rec_used = 0;
+    }
+
+    else if ( same_strings( word, batch_abort ) )
+    {
+        if ( batch_open )
+            settle_records( rec_buf, rec_used, hc_error_bad_batch );
+
+        batch_open = false;
+        rec_used = 0;
+    }
+
+    else if ( same_strings( word, batch_commit ) )
+    {
+        if ( batch_open && batch_err == 0 && ! take_batch_rate() ) // it takes effect together or not at all
+            batch_err = hc_error_rate_limited;
+
+        if ( batch_open && batch_err != 0 )
+        {
+            int err = batch_err == hc_error_rate_limited ? hc_error_rate_limited : hc_error_bad_batch;
+
+            settle_records( rec_buf, rec_used, err );
+            batch_open = false;
+            rec_used = 0;
+
+            if ( flags & hc_flag_interactive )
+            {
+                source->println( "\nBatch is dropped." );
+
+                if ( prompt != nullptr )
+                    source->print( prompt );
+            }
+
+            init_for_new_input( hc_state_invalid | (state & hc_state_EOL) );
+            set_error( err );
+
+            return -1;
+        }
+
+        if ( batch_open )
+        {
+            play_ptr = rec_buf;
+            play_left = rec_used;
+        }
+
+        batch_open = false;
+    }
+
+    else
+        return 1;
+
+    if ( seq >= 0 )
+        acknowledge();
+
+    // the rest of line is ignored
+    init_for_new_input( (state & hc_state_EOL) ? hc_state_clean : hc_state_invalid );
+
+    return 0;
+}
+
+/**
+* @brief Internal: parse the rest of the current command and store it into the batch as a record
+*
+* Record is: 2 bytes of little-endian length of the rest, command index and then parameters' fields,
+* exactly as in the binary frame. Can be continued on the next call if the data is not here yet.
+* The sequence tag of the command goes into the record too, as 0xFF and 4 bytes of little-endian number
+* before the command index. It is ACK'ed when the record is reported, not now.
+*
+* @param int - error code to set if the record does not fit into the storage
+* @return int: -2 if it does not fit, -1 on other error, 0 if command is incomplete yet, 1 if stored
+*/
+int host_command::capture( int _full )
+{
+    bool full = false;
+
+    if ( rec_start < 0 ) // new one: length placeholder, the tag if any and command's index
+    {
+        int tag = seq >= 0 ? record_seq_size : 0;
+
+        if ( rec_used + 3 + tag > rec_size )
+        {
+            set_error( _full );
+            state |= hc_state_invalid;
+
+            return -2;
+        }
+
+        rec_start = rec_used;
+        rec_used += 2;
+
+        if ( tag > 0 ) // the command is ACK'ed when it is reported from storage
+        {
+            rec_buf[ rec_used ] = record_seq;
+
+            for ( int i = 0; i < 4; ++i )
+                rec_buf[ rec_used + 1 + i ] = static_cast<uint8_t>( seq >> (8 * i) );
+
+            rec_used += tag;
+        }
+
+        rec_buf[ rec_used++ ] = static_cast<uint8_t>( cur_cmd );
+    }
+
+    while ( ! no_more_parameters() )
+    {
+        int rc = check_input();
+
+        if ( rc < 0 )
+            break;
+
+        if ( rc == 0 )
+        {
+            if ( no_more_parameters() ) // optional ones were omitted
+                break;
+
+            return 0;
+        }
+
+        long len = put_field( rec_buf + rec_used, rec_size - rec_used );
+
+        if ( len < 0 )
+        {
+            set_error( _full );
+            state |= hc_state_invalid;
+            full = true;
+        }
+
+        rec_used += len;
+    }
+
+    host_command_element *cmd = commands[ cur_cmd ];
+
+    if ( ! (state & hc_state_invalid) && cur_param + 1 < static_cast<int>( cmd->params.size() )
+         && cur_param + 1 < cmd->optional_start )
+    {
+        set_error( hc_error_required_missing );
+        state |= hc_state_invalid;
+    }
+
+    long len = rec_used - rec_start - 2;
+
+    if ( ! (state & hc_state_invalid) && len > 0xFFFF )
+    {
+        set_error( _full );
+        state |= hc_state_invalid;
+        full = true;
+    }
+
+    if ( state & hc_state_invalid )
+    {
+        rec_used = rec_start;
+        rec_start = -1;
+
+        return full ? -2 : -1;
+    }
+
+    rec_buf[ rec_start ] = static_cast<uint8_t>( len );
+    rec_buf[ rec_start + 1 ] = static_cast<uint8_t>( len >> 8 );
+    rec_start = -1;
+    seq = -1; // it is in the record now
+
+    return 1;
+}
+
+/**
+* @brief Internal: store the current parameter's data as a binary frame's field, e.g. to the record being captured
+*
+* @param uint8_t* - destination
+* @param long - room left there
+* @return long: the length of field or -1 if there is no room or the data is streamed and is gone already
+*/
+long host_command::put_field( uint8_t* dst, long room )
+{
+    uint32_t param = commands[ cur_cmd ]->params[ cur_param ];
+    long len;
+
+    if ( param & hcmd_f_stream )
+        return -1;
+
+    if ( param & (hcmd_t_bool | hcmd_t_byte) )
+    {
+        len = 1;
+
+        if ( room < len )
+            return -1;
+
+        dst[0] = ( param & hcmd_t_bool ) ? get_bool() : get_byte();
+    }
+
+    else if ( param & (hcmd_t_int | hcmd_t_float) )
+    {
+        uint32_t bits;
+
+        if ( param & hcmd_t_int )
+            bits = static_cast<uint32_t>( static_cast<int32_t>( get_int() ) );
+        else
+        {
+            float f = get_float();
+            memcpy( &bits, &f, sizeof(bits) );
+        }
+
+        len = 4;
+
+        if ( room < len )
+            return -1;
+
+        for ( int i = 0; i < 4; ++i )
+            dst[i] = static_cast<uint8_t>( bits >> (8 * i) );
+    }
+
+    else if ( param & (hcmd_t_str | hcmd_t_qstr) )
+    {
+        const char* str = get_str();
+
+        len = static_cast<long>( strlen( str ) ) + 1;
+
+        if ( room < len )
+            return -1;
+
+        memcpy( dst, str, len );
+    }
+
+    else // binary types
+    {
+        int n = get_length();
+
+        len = n + 2;
+
+        if ( room < len )
+            return -1;
+
+        dst[0] = static_cast<uint8_t>( n );
+        dst[1] = static_cast<uint8_t>( n >> 8 );
+        memcpy( dst + 2, get_blob(), n );
+    }
+
+    return len;
+}
+
+/**
+* @brief Internal: start processing of the next stored record
+*
+* @return int: -1 on error, 1 if new command is here
+*/
+int host_command::next_record(void)
+{
+    long len = play_left < 2 ? 0 : ( play_ptr[0] | (play_ptr[1] << 8) );
+
+    if ( len < 1 || len + 2 > play_left ) // broken. nothing after it can be trusted
+    {
+        play_left = 0;
+        init_for_new_input( hc_state_invalid | hc_state_EOL );
+        set_error( hc_error_bad_frame );
+
+        return -1;
+    }
+
+    init_for_new_input( hc_state_clean );
+
+    frame = play_ptr + 2;
+    frame_len = static_cast<int>( len );
+    play_ptr += len + 2;
+    play_left -= len + 2;
+    played = true; // the batch's rate is taken on COMMIT. replay() is not limited
+    take_record_seq();
+
+    return open_frame();
+}
 
-            return -1;
-        }
+/**
+* @brief Internal: take the sequence tag of the record being opened, if any
+*
+* The tag is ACK'ed or NAK'ed as usual then, when the command is done with.
+*/
+void host_command::take_record_seq(void)
+{
+    if ( seq >= 0 ) // the previous one is left unfinished by its handler
+        acknowledge();
 
-        c = source->read();
+    if ( frame_len <= record_seq_size || frame[0] != record_seq )
+        return;
 
-        if ( c < 0 ) // error?
-            return -1;
+    seq = 0;
 
-        if( state & hc_state_invalid ) // waiting for invalidated input to be ended with LF
-        {
-            if ( c == '\n' || c == '\r' )
-                init_for_new_input( hc_state_clean );
+    for ( int i = 3; i >= 0; --i )
+        seq = (seq << 8) | frame[ 1 + i ];
+
+    frame += record_seq_size;
+    frame_len -= record_seq_size;
+}
+
+/**
+* @brief Internal: return the stored record past its length and the sequence tag, i.e. at command's index
+*
+* @param const uint8_t* - record
+* @return const uint8_t*: command's index and then the fields
+*/
+const uint8_t* host_command::record_body( const uint8_t* rec )
+{
+    return rec + 2 + ( rec[2] == record_seq ? record_seq_size : 0 );
+}
+
+/**
+* @brief Internal: send ACK or NAK for the tagged records that are dropped without being reported
+*
+* @param const uint8_t* - records
+* @param long - their total length
+* @param int - error code for NAK or hc_error_no_error for ACK
+*/
+void host_command::settle_records( const uint8_t* recs, long len, int err )
+{
+    for ( long pos = 0; pos + 2 < len; pos += 2 + ( recs[ pos ] | (recs[ pos + 1 ] << 8) ) )
+    {
+        const uint8_t* rec = recs + pos;
+
+        if ( rec[2] != record_seq )
+            continue;
 
+        long tag = 0;
+
+        for ( int i = 3; i >= 0; --i )
+            tag = (tag << 8) | rec[ 3 + i ];
+
+        reply( tag, err );
+    }
+}
+
+/**
+* @brief Internal: read the whole line into cache's line buffer and look for it in the cache
+*
+* On hit the cached command is ready for processing. On miss the line is left to be parsed from the buffer
+* and the slot is prepared to receive its command.
+*
+* @return int: 1 on hit, 0 if the line is incomplete yet, -1 on miss
+*/
+int host_command::cache_lookup(void)
+{
+    uint8_t* line = cache;
+    int len = read_line( line );
+
+    if ( len == 0 )
+        return 0;
+
+    line_len = 0;
+    in_ptr = line;
+    in_left = len;
+    cache_fill = -1;
+
+    if ( line[ len - 1 ] != '\n' && line[ len - 1 ] != '\r' ) // too long
+        return -1;
+
+    --len; // EOL is not counted
+
+    uint32_t hash = 2166136261UL; // FNV-1a
+
+    for ( int i = 0; i < len; ++i )
+        hash = ( hash ^ line[i] ) * 16777619UL;
+
+    for ( int i = 0; i < cache_slots; ++i )
+    {
+        uint8_t* slot = cache + buf_len + i * cache_slot_size;
+
+        if ( ( slot[4] | (slot[5] << 8) ) != len || get_le32( slot ) != hash
+             || memcmp( slot + cache_slot_header, line, len ) != 0 ) // hash is only a hint. collisions do happen
             continue;
+
+        ++cache_hits;
+        in_left = 0;
+
+        uint8_t* rec = slot + cache_slot_header + len;
+
+        init_for_new_input( hc_state_clean );
+        frame = rec + 2;
+        frame_len = rec[0] | (rec[1] << 8);
+
+        return open_frame() > 0 ? 1 : 0;
+    }
+
+    ++cache_misses;
+
+    if ( line[0] != sequence_tag // tagged lines are all different anyway
+         && len + 3 <= cache_slot_size - cache_slot_header ) // room for the line and the command ID at least
+    {
+        uint8_t* slot = cache + buf_len + cache_next * cache_slot_size;
+
+        cache_fill = cache_next;
+        line_hash = hash;
+        fill_line_len = static_cast<uint16_t>( len );
+        fill_pos = 0;
+        memset( slot, 0, cache_slot_header ); // not valid until complete
+        memcpy( slot + cache_slot_header, line, len );
+    }
+
+    return -1;
+}
+
+/**
+* @brief Internal: add the command name or the current parameter to the cache slot being filled.
+*
+* When the command is complete and the line is over, the slot becomes valid.
+*
+* @param bool - true if there is a new data to be stored
+*/
+void host_command::cache_put( bool _new )
+{
+    uint8_t* slot = cache + buf_len + cache_fill * cache_slot_size;
+    uint8_t* rec = slot + cache_slot_header + fill_line_len;
+    int room = cache_slot_size - cache_slot_header - fill_line_len;
+
+    if ( state & hc_state_invalid )
+    {
+        cache_fill = -1;
+        return;
+    }
+
+    if ( _new )
+    {
+        if ( cur_param == -1 ) // command name
+        {
+            rec[2] = static_cast<uint8_t>( cur_cmd );
+            fill_pos = 3;
         }
 
-        if ( state & hc_state_escape ) // this char is escaped
+        else
         {
-            state &= ~hc_state_escape;
+            long len = put_field( rec + fill_pos, room - fill_pos );
 
-            buf[ buf_pos++ ] = c;
+            if ( len < 0 ) // no room or streamed one
+            {
+                cache_fill = -1;
+                return;
+            }
 
-            continue;
+            fill_pos += static_cast<int>( len );
         }
+    }
 
-		// always drop leading spaces in simple cases, but not in quoted strings (if we got some already)
-        if ( buf_pos == 0 && c != '\n' && c != '\r' && !(state & hc_state_got_quotes)
-             && isspace(c))
+    if ( ! no_more_parameters() )
+        return;
+
+    host_command_element *cmd = commands[ cur_cmd ];
+
+    if ( cur_param + 1 < static_cast<int>( cmd->params.size() ) && cur_param + 1 < cmd->optional_start )
+    {
+        cache_fill = -1; // required parameter is missing
+        return;
+    }
+
+    for ( int i = 0; i < in_left; ++i ) // some more commands on this line?
+    {
+        if ( ! isspace( in_ptr[i] ) )
         {
+            cache_fill = -1;
+            return;
+        }
+    }
+
+    int len = fill_pos - 2;
+
+    rec[0] = static_cast<uint8_t>( len );
+    rec[1] = static_cast<uint8_t>( len >> 8 );
+
+    for ( int i = 0; i < 4; ++i )
+        slot[i] = static_cast<uint8_t>( line_hash >> (8 * i) );
+
+    slot[4] = static_cast<uint8_t>( fill_line_len );
+    slot[5] = static_cast<uint8_t>( fill_line_len >> 8 );
+
+    cache_next = static_cast<uint8_t>( ( cache_fill + 1 ) % cache_slots );
+    cache_fill = -1;
+}
+
+/**
+* @brief Internal: read the source into line buffer until the line is complete
+*
+* The line is kept there until the caller resets line_len. Empty lines are skipped.
+*
+* @param uint8_t* - line buffer of buf_len size
+* @return int: line's length with EOL, buf_len if it is too long, or 0 if the line is incomplete yet
+*/
+int host_command::read_line( uint8_t* line )
+{
+    for(;;)
+    {
+        int len = line_len;
+
+        if ( len > 0 && ( len == buf_len || line[ len - 1 ] == '\n' || line[ len - 1 ] == '\r' ) )
+            return len;
+
+        if ( source->available() <= 0 || spend_work( 1 ) == 0 )
+            return 0;
+
+        int c = source->read();
+        hc_stat( bytes++ );
+
+        if ( c < 0 )
+            return 0;
+
+        if ( ( c == '\n' || c == '\r' ) && len == 0 ) // empty one
             continue;
+
+        if ( len == 0 && bl_line == nullptr ) // backlog's commands are timed from the moment they are reported
+            hist_start();
+
+        line[ line_len++ ] = c;
+    }
+}
+
+/**
+* @brief Internal: read all the available lines ahead and report the most urgent command from backlog
+*
+* The command is reported only when no line is being parsed. The errors are reported as usual.
+* The first one of the highest priority is taken.
+*
+* @return int: 1 if command is reported, 0 if there is none now, -1 if the batch is being processed the usual way
+*/
+int host_command::backlog_next(void)
+{
+    if ( bl_taken >= 0 ) // done with it
+    {
+        if ( seq >= 0 ) // its handler left it unfinished
+            acknowledge();
+
+        drop_record( bl_taken );
+        bl_taken = -1;
+        init_for_new_input( hc_state_clean );
+    }
+
+    if ( play_left == 0 && ! batch_open )
+        fill_backlog();
+
+    if ( bl_used == 0 )
+        return ( play_left > 0 || batch_open ) ? -1 : 0;
+
+    if ( bl_start >= 0 || in_left > 0 || state != hc_state_clean )
+        return 0;
+
+    long at = 0;
+    int best = -1;
+
+    for ( long pos = 0; pos < bl_used; pos += 2 + ( backlog[ pos ] | (backlog[ pos + 1 ] << 8) ) )
+    {
+        int prio = commands[ record_body( backlog + pos )[0] ]->priority;
+
+        if ( prio > best )
+        {
+            best = prio;
+            at = pos;
         }
+    }
 
-        if ( c == '\n' || c == '\r' || c == ' ' || c == '\t' ) // checking for EOL or end of cmd/param
+    bl_taken = at;
+    frame = backlog + at + 2;
+    frame_len = backlog[ at ] | (backlog[ at + 1 ] << 8);
+    take_record_seq();
+
+    return open_frame() > 0 ? 1 : 0;
+}
+
+/**
+* @brief Internal: parse the complete lines available into the backlog, while there is a room for them
+*
+* Stops on error or on batch control word, leaving the rest of input for the usual processing.
+*/
+void host_command::fill_backlog(void)
+{
+    for(;;)
+    {
+        if ( batch_open || play_left > 0 ) // the batch goes the usual way
+            return;
+
+        if ( bl_start < 0 && in_left == 0 && state == hc_state_clean ) // between the lines
         {
-            if ( ! (state & hc_state_got_some) && ( c == '\n' || c == '\r' ) ) // skipping empty lines quick
-                continue;
+            if ( bl_held > 0 ) // the rest of input may be the raw data for a handler
+                return;
 
-            if ( state & hc_state_cmd ) // command name
-            {
-                //if (buf_pos == 0)
-                //{
-                //    init_for_new_input(hc_state_clean);
-                //    continue;
-                //}
+            int len = read_line( bl_line );
 
-                if ( c == '\n' || c == '\r' )
-                    state |= hc_state_EOL;
+            if ( len == 0 || bl_size - bl_used < 2L * len + 3 ) // no line or no room for its commands yet
+                return;
 
-                state |= hc_state_complete;
+            line_len = 0;
+            in_ptr = bl_line;
+            in_left = len;
+        }
 
-                buf[ buf_pos ] = '\0';
+        if ( bl_start < 0 )
+        {
+            int rc = check_input();
 
-                break; // exit loop to validate command name
+            if ( rc < 0 )
+                return;
+
+            if ( rc == 0 )
+            {
+                if ( work_left == 0 ) // enough for this call
+                    return;
+
+                if ( in_left == 0 && state != hc_state_clean ) // the rest of too long line is not here yet
+                    return;
+
+                continue;
             }
+        }
 
-            // we have parameter here
+        long at = bl_start >= 0 ? bl_start : bl_used;
 
-            host_command_element *cmd = commands[ cur_cmd ];
+        swap_records( backlog, bl_size, bl_used, bl_start );
+        int rc = capture( hc_error_param_too_long ); // the line that does not fit is too long for the backlog
+        swap_records( backlog, bl_size, bl_used, bl_start );
 
-            // any space is valid in quoted string (if we're not over the limit though)
-            if ( cmd->params[ cur_param ] & hcmd_t_qstr && ! ( state & hc_state_skip ) )
+        if ( rc == 0 ) // the rest of too long line is not here yet or enough for this call
+            return;
+
+        if ( rc < 0 )
+        {
+            if ( rc == -2 )
+                hc_stat( overflows++ );
+
+            return;
+        }
+
+        if ( commands[ cur_cmd ]->data_follows )
+            ++bl_held;
+
+        coalesce( at );
+
+        if ( seq >= 0 )
+            acknowledge();
+
+        discard(); // skip the rest of command if any
+    }
+}
+
+/**
+* @brief Internal: exchange the batch records storage with the backlog or held command's one, so capture() can fill any of them
+*
+* @param uint8_t*& - the other storage
+* @param long& - its size
+* @param long& - its bytes used
+* @param long& - offset of the record being captured there
+*/
+void host_command::swap_records( uint8_t*& _buf, long& _size, long& _used, long& _start )
+{
+    uint8_t* p = rec_buf;
+    rec_buf = _buf;
+    _buf = p;
+
+    long n = rec_size;
+    rec_size = _size;
+    _size = n;
+
+    n = rec_used;
+    rec_used = _used;
+    _used = n;
+
+    n = rec_start;
+    rec_start = _start;
+    _start = n;
+}
+
+/**
+* @brief Internal: drop the older commands in backlog that are superseded by the record just added
+*
+* @param long - offset of the new record
+*/
+void host_command::coalesce( long at )
+{
+    const uint8_t* rec = backlog + at;
+    int cmd = record_body( rec )[0];
+    int key = commands[ cmd ]->coalesce_key;
+
+    if ( key == no_coalescing )
+        return;
+
+    long key_len = 0;
+    const uint8_t* key_data = nullptr;
+
+    if ( key >= 0 )
+    {
+        key_data = record_field( rec, key, &key_len );
+
+        if ( key_data == nullptr ) // no key - no peers
+            return;
+    }
+
+    long pos = 0;
+
+    while ( pos < at )
+    {
+        const uint8_t* old = backlog + pos;
+
+        if ( record_body( old )[0] == cmd )
+        {
+            long len = 0;
+            const uint8_t* data = key >= 0 ? record_field( old, key, &len ) : nullptr;
+
+            if ( key < 0 || ( data != nullptr && len == key_len && memcmp( data, key_data, len ) == 0 ) )
             {
-                buf[ buf_pos++ ] = c;
+                long size = 2 + ( old[0] | (old[1] << 8) );
+
+                settle_records( old, size, hc_error_no_error ); // the newer one does its job
+                drop_record( pos );
+                at -= size;
+                rec = backlog + at;
+                key_data -= key_data != nullptr ? size : 0;
 
                 continue;
             }
+        }
 
-            if ( c == '\n' || c == '\r' )
-            {
-                state |= hc_state_EOL;
+        pos += 2 + ( old[0] | (old[1] << 8) );
+    }
+}
 
-                // checking if this or next param is not optional
-                if ( buf_pos == 0 ||
-                     ( cur_param + 1 < static_cast<int>(cmd->params.size()) &&
-                       cur_param + 1 < cmd->optional_start ) )
-                {
-                    if ( flags & hc_flag_interactive )
-                    {
-                        source->print( "\nAttempt to skip non-optional parameter #" );
-                        source->println( cur_param + 1 );
+/**
+* @brief Internal: remove the record from backlog
+*
+* @param long - record's offset
+*/
+void host_command::drop_record( long at )
+{
+    long size = 2 + ( backlog[ at ] | (backlog[ at + 1 ] << 8) );
 
-                        if ( prompt != nullptr )
-                            source->print( prompt );
-                    }
+    if ( commands[ record_body( backlog + at )[0] ]->data_follows )
+        --bl_held;
 
-                    err_code = hc_error_required_missing;
+    memmove( backlog + at, backlog + at + size, bl_used - at - size );
+    bl_used -= size;
+}
 
-                    state |= hc_state_invalid;
+/**
+* @brief Internal: find the parameter's field in the stored record
+*
+* @param const uint8_t* - record
+* @param int - parameter's index
+* @param long* - where to put the field's length
+* @return const uint8_t*: field or nullptr if the parameter was omitted
+*/
+const uint8_t* host_command::record_field( const uint8_t* rec, int index, long* len ) const
+{
+    const uint8_t* body = record_body( rec );
+    host_command_element *cmd = commands[ body[0] ];
+    long end = 2 + ( rec[0] | (rec[1] << 8) );
+    long pos = body + 1 - rec;
 
-                    return -1;
-                }
-            } // if EOL
+    for ( int i = 0; i <= index; ++i )
+    {
+        if ( pos >= end )
+            return nullptr;
 
-            state |= hc_state_complete;
+        uint32_t param = cmd->params[i];
+        long size;
 
-            buf[ buf_pos ] = '\0';
+        if ( param & (hcmd_t_bool | hcmd_t_byte) )
+            size = 1;
 
-            return 1; // got another complete parameter
-        } // got EOL or space
+        else if ( param & (hcmd_t_int | hcmd_t_float) )
+            size = 4;
 
-        if ( state & hc_state_skip ) // we need to skip till this param end
-            continue;
+        else if ( param & (hcmd_t_str | hcmd_t_qstr) )
+            size = static_cast<long>( strlen( (const char*)rec + pos ) ) + 1;
 
-        if ( (flags & hc_flag_escapes) && c == '\\' )
-        {
-            state |= hc_state_escape;
+        else // binary types
+            size = 2 + ( rec[ pos ] | (rec[ pos + 1 ] << 8) );
 
-            continue;
+        if ( i == index )
+        {
+            *len = size;
+            return rec + pos;
         }
 
-        if ( state == hc_state_clean || state & hc_state_cmd ) // still waiting for a command name to complete
-        {
-            buf[ buf_pos++ ] = c;
-            state |= hc_state_cmd;
+        pos += size;
+    }
 
-            continue;
-        }
+    return nullptr;
+}
 
-        // we wait for parameter here:
+/**
+* @brief Internal: return the number of input bytes available: the rest of the cached line or from the source
+*
+* @return int
+*/
+int host_command::input_available(void)
+{
+    if ( in_left > 0 )
+        return in_left;
 
-        host_command_element *cmd = commands[ cur_cmd ];
+    if ( bl_line != nullptr && ! batch_open && state == hc_state_clean && in_ptr != nullptr
+         && ( in_ptr[-1] == '\n' || in_ptr[-1] == '\r' ) )
+        return 0; // the whole line is parsed. the next one goes into backlog first. raw data may go beyond it
 
-        // checking if our parameter is within user-requested size
-        // NOTE: (now) this is used for strings only
-        if ( cmd->params[cur_param] & 0xffff
-             && ( static_cast<int>( cmd->params[cur_param] & 0xffff ) == buf_pos ) )
-        {
-            state |= hc_state_skip;
-            buf[ buf_pos ] = '\0';
-            continue;
-        }
+    if ( cache_fill >= 0 ) // command goes beyond the line. can't be cached
+        cache_fill = -1;
 
-        // Quoted strings
-        if ( cmd->params[ cur_param ] & hcmd_t_qstr )
-        {
-            if (c == '"' || c == '\'') // check for the beginning/ending quote
-            {
-                if ( ! (state & hc_state_got_quotes) ) // is it the opening quote?
-                {
-                    // remember what type of quote used at the beginning
-                    if (c == '"')
-                        state |= hc_state_d_quote;
-                    else
-                        state |= hc_state_s_quote;
+    return source->available();
+}
 
-                    continue; // don't store quotes
-                }
+/**
+* @brief Internal: read the next input byte: from the rest of the cached line or from the source
+*
+* @return int: byte or -1 on error
+*/
+int host_command::input_read(void)
+{
+    if ( in_left > 0 )
+    {
+        --in_left;
+        return *in_ptr++;
+    }
 
-                else if ( (c == '"' && (state & hc_state_d_quote)) // matching closing quote?
-                    || (c == '\'' && (state & hc_state_s_quote)) )
-                {
-                    state |= hc_state_complete;
+    hc_stat( bytes++ );
+    return source->read();
+}
 
-                    buf[buf_pos] = '\0';
+/**
+* @brief Internal: read several input bytes: from the rest of the cached line or from the source
+*
+* @param uint8_t* - destination
+* @param int - max length
+* @return int: number of bytes read
+*/
+int host_command::input_read_bytes( uint8_t* dst, int len )
+{
+    if ( in_left > 0 )
+    {
+        if ( len > in_left )
+            len = in_left;
 
-                    return 1;
-                }
-            } // got quote
+        memmove( dst, in_ptr, len ); // may overlap if the buffer is shared
+        in_ptr += len;
+        in_left -= len;
 
-            // if 1st char is not a quote then set error state
-            else if ( buf_pos == 0 && ! (state & hc_state_got_quotes))
-            {
-                err_code = hc_error_missing_quotes;
+        return len;
+    }
 
-                state |= hc_state_invalid;
-                
-                return -1;
-            }
-        } // if quoted string?
+    len = static_cast<int>( source->readBytes( (char*)dst, len ) );
+    hc_stat( bytes += len );
 
-        //TODO: check if no quotes was used
-        //TODO: check for maximum string length
+    return len;
+}
 
-        buf[ buf_pos++ ] = c;
+/**
+* @brief Internal: return the number stored in the current parameter's field of binary frame
+*
+* @return long: number. strings and binary data are 0
+*/
+long host_command::field_int(void) const
+{
+    uint32_t param = commands[ cur_cmd ]->params[ cur_param ];
 
-    } //for() loop over all available data in stream
+    if ( param & (hcmd_t_bool | hcmd_t_byte) )
+        return field[0];
 
-    // checking if we know this command
-    cur_cmd = find_command_index((const char*)buf);
+    if ( param & hcmd_t_int )
+        return static_cast<int32_t>( get_le32( field ) );
 
-    if ( cur_cmd == -1 )
-    {
-        if (flags & hc_flag_interactive)
-        {
-            source->println("\nUnknown command.");
+    if ( param & hcmd_t_float )
+        return static_cast<long>( field_float() );
 
-            if (prompt != nullptr)
-                source->print(prompt);
-        }
+    return 0;
+}
+
+/**
+* @brief Internal: return the floating point number stored in the current parameter's field of binary frame
+*
+* @return float: number. strings and binary data are 0
+*/
+float host_command::field_float(void) const
+{
+    uint32_t param = commands[ cur_cmd ]->params[ cur_param ];
 
-        init_for_new_input(hc_state_invalid);
+    if ( ! (param & hcmd_t_float) )
+        return static_cast<float>( field_int() );
 
-        return -1;
-    }
+    uint32_t bits = get_le32( field );
+    float f;
 
-    return 1;
-} // int check
+    memcpy( &f, &bits, sizeof(f) );
+
+    return f;
+}
 
 /**
 * @brief Internal: return index of command by it's name
@@ -914,25 +4375,35 @@ bool host_command::get_bool( void ) const
     if ( cur_cmd == -1 || state & hc_state_invalid || cur_param == -1 )
         return false;
 
+    const char* str = (const char*)buf;
+
+    if ( state & hc_state_frame )
+    {
+        if ( ! (commands[ cur_cmd ]->params[ cur_param ] & (hcmd_t_str | hcmd_t_qstr)) )
+            return field_int() != 0;
+
+        str = (const char*)field;
+    }
+
     // assume that we'll deal with 'ok','on','true','y','yes' or non-zero number as true
-    char first = tolower(*buf);
+    char first = tolower(*str);
 
     // on/ok
-    if (first == 'o' && buf[2] == '\0' && ( tolower(buf[1]) == 'k' || tolower(buf[1]) == 'n' ) )
+    if (first == 'o' && str[1] != '\0' && str[2] == '\0' && ( tolower(str[1]) == 'k' || tolower(str[1]) == 'n' ) )
         return true;
 
     if (first == 't')
-        return same_strings( (const char*)buf, "true" );
+        return same_strings( str, "true" );
 
     if (first == 'y')  // y/yes
     {
-        if ( buf[1] ) // check for full word
-            return same_strings( (const char*)buf, "yes" );
+        if ( str[1] ) // check for full word
+            return same_strings( str, "yes" );
         else
             return true;
     }
 
-    char *c = (char*)buf; // check if a non-zero number
+    const char *c = str; // check if a non-zero number
     while ( isdigit(*c) )
     {
         if ( *c != '0' )
@@ -953,6 +4424,9 @@ uint8_t host_command::get_byte( void ) const
     if ( cur_cmd == -1 || state & hc_state_invalid || cur_param == -1 )
         return 0;
 
+    if ( state & hc_state_frame )
+        return field[0];
+
     return buf[0];
 }
 
@@ -966,6 +4440,14 @@ int host_command::get_int( void ) const
     if ( cur_cmd == -1 || state & hc_state_invalid || cur_param == -1 )
         return 0;
 
+    if ( state & hc_state_frame )
+    {
+        if ( commands[ cur_cmd ]->params[ cur_param ] & (hcmd_t_str | hcmd_t_qstr) )
+            return atoi( (const char*)field );
+
+        return static_cast<int>( field_int() );
+    }
+
     return atoi( (const char*)buf );
 }
 
@@ -979,6 +4461,14 @@ float host_command::get_float( void ) const
     if ( cur_cmd == -1 || state & hc_state_invalid || cur_param == -1 )
         return 0.0f;
 
+    if ( state & hc_state_frame )
+    {
+        if ( commands[ cur_cmd ]->params[ cur_param ] & (hcmd_t_str | hcmd_t_qstr) )
+            return static_cast<float>(atof( (const char*)field ));
+
+        return field_float();
+    }
+
     return static_cast<float>(atof( (char*)buf ));
 }
 
@@ -999,6 +4489,10 @@ const char* host_command::get_str( void )
         return (const char*)buf;
     }
 
+    // strings are zero-terminated in frame already. binary data is not, so use get_blob() for it
+    if ( state & hc_state_frame )
+        return (const char*)field;
+
     if ( buf_pos == buf_len )
         buf[buf_pos - 1] = '\0';
     else
@@ -1007,6 +4501,40 @@ const char* host_command::get_str( void )
     return (const char*)buf;
 }
 
+/**
+ * @brief Return parameter as a decoded binary data.
+ *
+ * Use get_length() to get the data size.
+ * For the streamed parameters all data was already passed to the sink.
+ *
+ * @return const uint8_t*
+ */
+const uint8_t* host_command::get_blob( void ) const
+{
+    if ( state & hc_state_frame )
+        return field;
+
+    return buf;
+}
+
+/**
+ * @brief Return the length of current parameter's data.
+ *
+ * For the streamed parameters this is the total amount of data passed to the sink.
+ *
+ * @return int: length in bytes
+ */
+int host_command::get_length( void ) const
+{
+    if ( cur_cmd == -1 || state & hc_state_invalid || cur_param == -1 )
+        return 0;
+
+    if ( state & hc_state_frame )
+        return field_len;
+
+    return streamed_len + buf_pos;
+}
+
 /**
 * @brief Fill arbitrary buffer with requested number of bytes from the pre-set source for this object.
 *
@@ -1015,6 +4543,7 @@ const char* host_command::get_str( void )
 * and then use this method to get the data you need.
 * Function will block until max_time is out or requested amount of data is received.
 * Use limit_time() to set max_time if you want to have a timeout.
+* This is a blocking wrapper around begin_receive()/poll_receive().
 * 
 * @param char* - destination buffer
 * @param int - amount of data to get
@@ -1022,37 +4551,278 @@ const char* host_command::get_str( void )
 */
 bool host_command::fill_buffer(char* dst, int len)
 {
-    int dst_offset = 0;
-    int need_count = 0;
-    unsigned work_till = max_time > 0 ? millis() + max_time : 0;
+    if ( ! begin_receive( dst, len, max_time ) )
+        return false;
+
+    int rc;
+
+    while ( ( rc = poll_receive() ) == 0 )
+        yield(); // let the framework do its job while we wait
+
+    return rc > 0;
+}
+
+/**
+* @brief Start the non-blocking bulk receive of requested number of bytes into arbitrary buffer.
+*
+* Call poll_receive() regularly then to move the data from the source into the buffer.
+* Nothing is read until the first poll, so it is safe to start it from inside command's processing.
+*
+* @param char* - destination buffer
+* @param int - amount of data to get
+* @param long - timeout in milliseconds since the start. <= 0 for no timeout
+* @return bool: false if parameters are invalid
+*/
+bool host_command::begin_receive(char* dst, int len, long timeout)
+{
+    if ( dst == nullptr || len < 0 )
+        return false;
+
+    bulk_bufs[0] = bulk_bufs[1] = dst;
+    consumer = nullptr;
+
+    return start_bulk( len, len, timeout );
+}
+
+/**
+* @brief Start the non-blocking bulk receive of requested number of bytes via two alternating buffers.
+*
+* When one buffer is full it is handed over to the consumer and the other one is being filled meanwhile.
+* The consumer should call release_buffer() when it's done with the data. It may be done right from the callback,
+* or later, e.g. when the flash write is complete. If both buffers are still held by the consumer
+* then no data is read from the source until one is released.
+* Call poll_receive() regularly to keep things going. The last chunk may be shorter than the buffer.
+*
+* @param char* - 1st buffer
+* @param char* - 2nd buffer
+* @param int - length of each buffer
+* @param long - total amount of data to get
+* @param host_command_consumer - receiver of the full buffers
+* @param long - timeout in milliseconds since the start. <= 0 for no timeout
+* @return bool: false if parameters are invalid
+*/
+bool host_command::begin_receive(char* dst1, char* dst2, int len, long total, host_command_consumer _consumer, long timeout)
+{
+    if ( dst1 == nullptr || dst2 == nullptr || _consumer == nullptr || len <= 0 || total < 0 )
+        return false;
+
+    bulk_bufs[0] = dst1;
+    bulk_bufs[1] = dst2;
+    consumer = _consumer;
+
+    return start_bulk( len, total, timeout );
+}
+
+/**
+* @brief Internal: reset the bulk receive state
+*
+* @param int - length of buffer
+* @param long - total amount of data to get
+* @param long - timeout in milliseconds
+* @return bool: always true
+*/
+bool host_command::start_bulk(int len, long total, long timeout)
+{
+    bulk_fill = 0;
+    bulk_busy = 0;
+    bulk_dst = bulk_bufs[0];
+    bulk_len = len;
+    bulk_pos = 0;
+    bulk_total = total;
+    bulk_received = 0;
+    set_deadline( bulk_deadline, ms_to_ticks( timeout ) );
+
+    return true;
+}
+
+/**
+* @brief Tell that the consumer is done with the oldest buffer handed over to it
+*/
+void host_command::release_buffer(void)
+{
+    if ( bulk_busy > 0 )
+        --bulk_busy;
+}
 
+/**
+* @brief Move the available data from the source into the buffer set by begin_receive(). Never blocks.
+*
+* For double-buffered receive the full buffers are handed over to the consumer from here.
+*
+* @return int: 1 if all data is received (and consumed), 0 if still in progress, -1 on error or timeout
+*/
+int host_command::poll_receive(void)
+{
+    if ( bulk_dst == nullptr )
+        return -1;
 
-    for (; len ; delay(200)) // we'll loop while there is still some data in the stream
+    while ( bulk_received < bulk_total )
     {
-        if ( work_till ) // timeout is set - checking
+        if ( bulk_busy == 2 ) // consumer is behind. leave the data in the source
+            return bulk_timeout();
+
+        int count = source->available();
+
+        if ( count < 0 ) // some error
         {
-            if ( millis() >= work_till )
-                return -1;
+            bulk_dst = nullptr;
+            return -1;
         }
 
-        int count = source->available();
+        if ( count == 0 ) // nothing yet
+            return bulk_timeout();
 
-        if (count < 0) // some error
-            return false;
+        if ( count > bulk_len - bulk_pos )
+            count = bulk_len - bulk_pos;
 
-        if (count == 0) // nothing yet
-            continue;
+        if ( count > bulk_total - bulk_received )
+            count = static_cast<int>( bulk_total - bulk_received );
 
-        need_count = count < len ? count : len;
+        count = static_cast<int>( source->readBytes( bulk_dst + bulk_pos, count ) );
 
-        count = static_cast<int>(source->readBytes(dst + dst_offset, need_count));
-        
-        if (count < 0) // some error
-			return false;
+        if ( count <= 0 ) // source changed its mind
+            return bulk_timeout();
 
-        dst_offset += count;
-		len -= count;
+        bulk_pos += count;
+        bulk_received += count;
+
+        if ( consumer != nullptr && ( bulk_pos == bulk_len || bulk_received == bulk_total ) )
+        {
+            ++bulk_busy; // before the call, so consumer can release it right away
+
+            consumer( this, reinterpret_cast<uint8_t*>( bulk_dst ), bulk_pos, bulk_received == bulk_total );
+
+            bulk_fill ^= 1;
+            bulk_dst = bulk_bufs[ bulk_fill ];
+            bulk_pos = 0;
+        }
     }
-    
-    return true;
+
+    if ( bulk_busy > 0 ) // waiting for the consumer to finish
+        return bulk_timeout();
+
+    return 1;
+}
+
+/**
+* @brief Internal: end the bulk receive with the timeout error if its deadline has passed
+*
+* @return int: -1 if it is timed out, 0 if not
+*/
+int host_command::bulk_timeout(void)
+{
+    if ( ! is_past( bulk_deadline ) )
+        return 0;
+
+    hc_stat( timeouts++ );
+    set_error( hc_error_timeout );
+    bulk_dst = nullptr;
+
+    return -1;
+}
+
+/**
+* @brief Return the number of bytes received by the current/last bulk receive
+*
+* @return long
+*/
+long host_command::get_received(void) const
+{
+    return bulk_received;
+}
+
+/**
+* @brief Internal: tell if the current command is to be continued rather than replaced by the next one
+*
+* get_next_command() leaves the command alone until its required parameters are complete,
+* so being asked for the next command it would report the same one again and lose its parameter.
+*
+* @return bool: true if the command waits for the rest of its parameters and there is the input to go on
+*/
+bool host_command::is_resumable(void)
+{
+    if ( ! is_unfinished() )
+        return false;
+
+    return in_left > 0 || source->available() > 0;
+}
+
+//===================================================================
+/**
+ * @brief Construct the poller of several host_command instances
+ *
+ * The budget is set with limit_work() of every instance, so a long line on one source can't hold the others.
+ * Note that it is applied to has_next_parameter() too.
+ *
+ * @param host_command**: array of instances. It is used as is, not copied
+ * @param uint8_t: number of instances
+ * @param int: input bytes each instance may process per call. <= 0 - no limit
+ */
+host_command_mux::host_command_mux( host_command** _hcs, uint8_t _count, int _budget )
+{
+    hcs = _hcs;
+    count = _count;
+    next = 0;
+    last = -1;
+    continued = false;
+
+    for ( uint8_t i = 0; i < count; ++i )
+        hcs[i]->limit_work( _budget, 0 );
+}
+
+/**
+ * @brief Poll the instances in turn, starting from the one after the instance that had the command last time
+ *
+ * Every instance is polled once at most. The command is processed with the instance returned, as usual:
+ * has_next_parameter(), getters, etc.
+ * When the budget ran out before the required parameters, the same instance is returned again once there is more input,
+ * with the same command. See is_continued(). Asking it for the next command instead would report the command again
+ * and lose its parameter.
+ *
+ * @return host_command*: the instance having the new command or nullptr if none has
+ */
+host_command* host_command_mux::get_next_command(void)
+{
+    for ( uint8_t n = 0; n < count; ++n )
+    {
+        uint8_t i = next;
+
+        if ( ++next == count )
+            next = 0;
+
+        continued = hcs[i]->is_resumable();
+
+        if ( continued || hcs[i]->get_next_command() )
+        {
+            last = i;
+            return hcs[i];
+        }
+    }
+
+    last = -1;
+
+    return nullptr;
+}
+
+/**
+ * @brief Return the index of the instance returned by get_next_command() last time
+ *
+ * @return int: -1 if none
+ */
+int host_command_mux::get_index(void) const
+{
+    return last;
+}
+
+/**
+ * @brief Tell if the instance returned by get_next_command() last time goes on with the same command
+ *
+ * It is so when the budget ran out in the middle of the command. has_next_parameter() gives the parameters
+ * not received yet, the ones already given are not repeated.
+ *
+ * @return bool
+ */
+bool host_command_mux::is_continued(void) const
+{
+    return last >= 0 && continued;
 }
@@ -0,0 +1,288 @@
+/**
+ * @file bench.cpp
+ * @author Andrej Pakhutin (pakhutin <at> gmail.com)
+ * @brief Microbenchmarks for class host_command
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Every workload is a long input of typical lines, read right from memory by bench_Stream.
+ * All the commands and parameters are taken with the getters, as the real sketch would do.
+ * The results are printed as a table and, if the file name is given, written there as JSON lines:
+ *   ./host_command_bench bench_results.json
+ *
+ * The repo is in github.com/kadavris
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "bench_Stream.hpp"
+#include "../include/host_command.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#endif
+
+unsigned long millis()
+{
+    return (unsigned long)( std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count() );
+}
+
+unsigned long micros()
+{
+    return (unsigned long)( std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count() );
+}
+
+bench_Stream Serial;
+
+namespace {
+
+const int repeats = 5; // the best run is taken
+const size_t input_size = 1 << 20; // bytes per run, roughly
+
+struct workload
+{
+    const char* name;
+    void (*define)(host_command&); // commands setup
+    std::string (*line)(unsigned); // n-th input line
+};
+
+struct result
+{
+    size_t bytes;
+    long commands;
+    long params;
+    double ns;
+    double cycles;
+};
+
+unsigned next_random( unsigned& seed )
+{
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+//======================================================
+void define_short( host_command& hc )
+{
+    hc.new_command( "LED", "d b" );
+    hc.new_command( "GET", "" );
+}
+
+std::string line_short( unsigned n )
+{
+    return n % 2 ? "GET\n" : "LED " + std::to_string( n % 8 ) + ( n % 4 ? " on\n" : " off\n" );
+}
+
+//======================================================
+void define_table( host_command& hc )
+{
+    static std::vector<std::string> names; // host_command keeps the pointers
+
+    if ( names.empty() )
+    {
+        for ( int i = 0; i < 150; ++i )
+        {
+            char name[16];
+            snprintf( name, sizeof(name), "CMD%03d", i );
+            names.push_back( name );
+        }
+    }
+
+    for ( auto& name : names )
+        hc.new_command( name.c_str(), "d" );
+}
+
+std::string line_table( unsigned n )
+{
+    char line[32];
+    unsigned seed = n;
+
+    snprintf( line, sizeof(line), "CMD%03u %u\n", next_random( seed ) % 150, n % 1000 );
+
+    return line;
+}
+
+//======================================================
+void define_quoted( host_command& hc )
+{
+    hc.new_command( "NAME", "d q" );
+}
+
+std::string line_quoted( unsigned n )
+{
+    std::string text;
+
+    while ( text.length() < 200 )
+        text += "the quick brown fox jumps over the lazy dog ";
+
+    return "NAME " + std::to_string( n % 100 ) + " \"" + text + "\"\n";
+}
+
+//======================================================
+void define_numbers( host_command& hc )
+{
+    hc.new_command( "MOVE", "d d d f f f c" );
+}
+
+std::string line_numbers( unsigned n )
+{
+    char line[96];
+
+    snprintf( line, sizeof(line), "MOVE %d %d %u %.3f %.2f -%.4f %u\n",
+              (int)(n * 37 % 20000) - 10000, -(int)(n % 5000), n, n * 0.125, 3.25 + n % 7, n % 11 / 7.0, n % 256 );
+
+    return line;
+}
+
+//======================================================
+void define_escapes( host_command& hc )
+{
+    hc.new_command( "SAY", "q s" );
+}
+
+std::string line_escapes( unsigned n )
+{
+    return "SAY \"she said \\\"hi\\\" to C:\\\\path\\\\file \\'" + std::to_string( n ) + "\\'\" plain\\ word\n";
+}
+
+//======================================================
+void define_invalid( host_command& hc )
+{
+    hc.new_command( "SET", "d d" );
+}
+
+std::string line_invalid( unsigned n )
+{
+    switch ( n % 4 )
+    {
+        case 0: return "BOGUS 1 2 3\n";
+        case 1: return "SET x1 2\n";
+        case 2: return "SET 1\n";
+        default: return "#$%^& *()_+ \x01\x02\x7f garbage\n";
+    }
+}
+
+const workload workloads[] =
+{
+    { "short_commands", define_short, line_short },
+    { "table_150_commands", define_table, line_table },
+    { "long_quoted_strings", define_quoted, line_quoted },
+    { "number_heavy", define_numbers, line_numbers },
+    { "escapes", define_escapes, line_escapes },
+    { "invalid_flood", define_invalid, line_invalid },
+};
+
+//======================================================
+// the parse loop of a typical sketch. the checksum is to keep the getters from being optimized away
+void parse_all( host_command& hc, long& commands, long& params, unsigned long& sum )
+{
+    for(;;)
+    {
+        if ( ! hc.get_next_command() )
+        {
+            if ( Serial.available() == 0 )
+                return;
+
+            continue; // invalid input is skipped
+        }
+
+        ++commands;
+
+        while ( hc.has_next_parameter() )
+        {
+            ++params;
+
+            uint32_t info = hc.get_parameter_info();
+
+            if ( info & (hcmd_t_str | hcmd_t_qstr) )
+                sum += hc.get_str()[0];
+            else if ( info & hcmd_t_float )
+                sum += (unsigned long)hc.get_float();
+            else
+                sum += hc.get_int();
+        }
+    }
+}
+
+result run( const workload& w, unsigned long& sum )
+{
+    host_command hc( 256, &Serial );
+    std::string input;
+    result best = { 0, 0, 0, 0, 0 };
+
+    w.define( hc );
+
+    for ( unsigned n = 0; input.length() < input_size; ++n )
+        input += w.line( n );
+
+    for ( int r = 0; r < repeats; ++r )
+    {
+        long commands = 0, params = 0;
+
+        Serial.set_input( input.data(), static_cast<int>( input.length() ) );
+        hc.discard();
+
+        auto start = std::chrono::steady_clock::now();
+#ifdef HAVE_CYCLES
+        unsigned long long c0 = __rdtsc();
+#endif
+
+        parse_all( hc, commands, params, sum );
+
+#ifdef HAVE_CYCLES
+        double cycles = (double)( __rdtsc() - c0 );
+#else
+        double cycles = 0;
+#endif
+        double ns = std::chrono::duration<double, std::nano>( std::chrono::steady_clock::now() - start ).count();
+
+        if ( r == 0 || ns < best.ns )
+            best = { input.length(), commands, params, ns, cycles };
+    }
+
+    return best;
+}
+
+} // namespace
+
+//===================================================================
+int main( int argc, char** argv )
+{
+    FILE* json = nullptr;
+    unsigned long sum = 0;
+
+    if ( argc > 1 && ( json = fopen( argv[1], "w" ) ) == nullptr )
+    {
+        perror( argv[1] );
+        return 1;
+    }
+
+    printf( "%-22s %10s %10s %10s %12s %14s\n", "workload", "bytes", "commands", "ns/byte", "cycles/byte", "commands/sec" );
+
+    for ( const workload& w : workloads )
+    {
+        result r = run( w, sum );
+        double ns_per_byte = r.ns / r.bytes;
+        double cycles_per_byte = r.cycles / r.bytes;
+        double per_sec = r.commands * 1e9 / r.ns;
+
+        printf( "%-22s %10zu %10ld %10.2f %12.2f %14.0f\n", w.name, r.bytes, r.commands, ns_per_byte, cycles_per_byte, per_sec );
+
+        if ( json != nullptr )
+            fprintf( json, "{\"workload\":\"%s\",\"bytes\":%zu,\"commands\":%ld,\"params\":%ld,"
+                           "\"ns_per_byte\":%.3f,\"cycles_per_byte\":%.3f,\"commands_per_sec\":%.0f}\n",
+                     w.name, r.bytes, r.commands, r.params, ns_per_byte, cycles_per_byte, per_sec );
+    }
+
+    if ( json != nullptr )
+        fclose( json );
+
+    return sum == 42 ? 2 : 0; // practically never, but the compiler can't know it
+}
@@ -0,0 +1,63 @@
+#pragma once
+/**
+ * @file bench_Stream.hpp
+ * @author Andrej Pakhutin (pakhutin <at> gmail.com)
+ * @brief In-memory Stream for the microbenchmarks
+ *
+ * @copyright Copyright (c) 2023
+ *
+ * Unlike test_Stream there are no failures, pacing or output capture here: the input is read straight
+ * from the caller's memory and everything is inline, so the parser's own cost is measured.
+ * It replaces test_Stream when HOST_CMD_BENCH is defined.
+ * The repo is in github.com/kadavris
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+class bench_Stream
+{
+private:
+    const char* data; // the input. not copied
+    int len;          // its length
+    int pos;          // position in input
+
+public:
+    bench_Stream() : data( nullptr ), len( 0 ), pos( 0 ) {}
+
+    // benchmark interface
+    void set_input( const char* _data, int _len ) { data = _data; len = _len; pos = 0; }
+
+    // mockups
+    void setTimeout( int ) {}
+    int  available() { return len - pos; }
+    int  read() { return pos < len ? (unsigned char)data[ pos++ ] : -1; }
+
+    size_t readBytes( char* _buf, int _len )
+    {
+        if ( _len > len - pos )
+            _len = len - pos;
+
+        memcpy( _buf, data + pos, _len );
+        pos += _len;
+
+        return _len;
+    }
+
+    size_t write( uint8_t ) { return 1; }
+
+    template<typename T> void print( T ) {}
+    template<typename T> void println( T ) {}
+};
+
+extern bench_Stream Serial;
+
+using Stream = bench_Stream;
+using String = std::string;
+
+extern unsigned long millis();
+extern unsigned long micros();
+
+inline void yield() {}
@@ -8,35 +8,108 @@
  * @copyright Copyright (c) 2023
  *
  */
+#include <algorithm>
 #include <iostream>
+#include <stdio.h>
 #include "test_Stream.hpp"
 #include "../include/host_command.hpp"
 
 test_Stream Serial;
 
+unsigned long long virtual_ns = 0;
+
+unsigned long virtual_micros()
+{
+    return (unsigned long)(virtual_ns / 1000);
+}
+
+unsigned long virtual_millis()
+{
+    return (unsigned long)(virtual_ns / 1000000);
+}
+
+void advance_clock( unsigned long us )
+{
+    virtual_ns += 1000ull * us;
+}
+
 // test_Stream members:
 const char* test_Stream_tag = ". test_Stream: ";
 
+// with pacing on the data goes over the wire from now or after the previous one
 void test_Stream::add_input( std::string _s )
 {
+    size_t start = buf.length();
+
     buf += _s;
+    ready_at.resize( buf.length(), 0 );
+
+    if ( baud <= 0 )
+        return;
+
+    unsigned long long byte_ns = 10000000000ull / baud; // start, 8 data and stop bits
+
+    if ( line_free < virtual_ns )
+        line_free = virtual_ns;
+
+    for ( size_t i = start; i < buf.length(); i += chunk )
+    {
+        size_t end = i + chunk < buf.length() ? i + chunk : buf.length();
+        unsigned long long t = line_free + byte_ns * (end - start);
+
+        if ( jitter_ns > 0 )
+        {
+            rng = rng * 1103515245ul + 12345ul;
+            t += (rng >> 8) % jitter_ns;
+        }
+
+        if ( i > 0 && t < ready_at[ i - 1 ] ) // it's still a queue
+            t = ready_at[ i - 1 ];
+
+        for ( size_t j = i; j < end; ++j )
+            ready_at[j] = t;
+    }
+
+    line_free += byte_ns * (buf.length() - start);
 }
 
 void test_Stream::add_input( const char* _s )
 {
-    buf += _s;
+    add_input( std::string( _s ) );
 }
 
 void test_Stream::clear()
 {
     buf.clear();
+    ready_at.clear();
+    output.clear();
     pos = 0;
+    line_free = 0;
+}
+
+void test_Stream::set_pacing( long _baud, int _chunk, unsigned long _jitter_us )
+{
+    baud = _baud;
+    chunk = _chunk > 0 ? _chunk : 1;
+    jitter_ns = 1000ul * _jitter_us;
+    rng = 1;
+    line_free = 0;
+}
+
+int test_Stream::ready()
+{
+    if ( baud <= 0 ) // no pacing: all of it
+        return (int)(buf.length()) - pos;
+
+    // arrival times never go down
+    return (int)( std::upper_bound( ready_at.begin() + pos, ready_at.end(), virtual_ns ) - ready_at.begin() ) - pos;
 }
 
 test_Stream::test_Stream()
 {
     pos = 0;
     fail_percentage = 0;
+    set_pacing( 0 );
     //std::cout << test_Stream_tag << "Stream mockup created." << std::endl;
 }
 
@@ -56,7 +129,7 @@ int test_Stream::available()
     if (fail_percentage > 0 && rand() % 100 <= fail_percentage)
         return 0;
 
-    return (int)(buf.length()) - pos;
+    return ready();
 }
 
 // return the next byte or -1 on error
@@ -66,25 +139,66 @@ int test_Stream::read()
         return -1;
         
     if (pos < (int)buf.length())
-        return buf[pos++];
+    {
+        if (baud > 0 && ready_at[pos] > virtual_ns) // not here yet
+            return -1;
+
+        return (unsigned char)buf[pos++];
+    }
 
     if (pos > 0)
     {
         buf.clear();
+        ready_at.clear();
         pos = 0;
     }
 
     return -1;
 }
 
-size_t test_Stream::readBytes(char* buf, int len)
+// return the number of bytes copied into the _buf
+size_t test_Stream::readBytes(char* _buf, int len)
+{
+    if (fail_percentage > 0 && rand() % 100 <= fail_percentage)
+        return 0;
+
+    int count = ready();
+
+    if (count > len)
+        count = len;
+
+    if (count <= 0)
+        return 0;
+
+    buf.copy(_buf, count, pos);
+    pos += count;
+
+    return count;
+}
+
+// raw byte to the host. not echoed to the console
+size_t test_Stream::write(uint8_t c)
 {
-    //TODO: 
-    throw new std::runtime_error("test_Stream::readBytes is not implemented");
+    output += static_cast<char>(c);
+
+    return 1;
+}
+
+// no string streams here: the output does not allocate when its capacity is reserved. see test_No_Allocations
+static void put( std::string& out, const char* p ) { out += p; }
+static void put( std::string& out, const std::string& p ) { out += p; }
+
+static void put( std::string& out, long p )
+{
+    char b[24];
+
+    snprintf( b, sizeof(b), "%ld", p );
+    out += b;
 }
 
 template<typename T> void test_Stream::print(T p)
 {
+    put( output, p );
     std::cout << test_Stream_tag << p;
 }
 
@@ -92,9 +206,12 @@ template void test_Stream::print(char*);
 template void test_Stream::print(char const*);
 template void test_Stream::print(std::string);
 template void test_Stream::print(int);
+template void test_Stream::print(long);
 
 template<typename T> void test_Stream::println(T p)
 {
+    put( output, p );
+    output += '\n';
     std::cout << test_Stream_tag << p << std::endl;
 }
 
@@ -102,3 +219,4 @@ template void test_Stream::println(char*);
 template void test_Stream::println(char const*);
 template void test_Stream::println(std::string);
 template void test_Stream::println(int);
+template void test_Stream::println(long);
@@ -12,6 +12,7 @@
  * The repo is in github.com/kadavris
  */
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -23,7 +24,15 @@ class test_Stream
 {
 private:
     std::string buf; // current command being fed to parser
+    std::vector<unsigned long long> ready_at; // virtual time in ns when each byte of buf becomes available
     int pos; // position in buffer
+    long baud; // paced delivery: line speed, 8N1. 0 - everything is available at once
+    int chunk; // paced delivery: bytes handed over at once, like UART FIFO or DMA block
+    unsigned long jitter_ns; // paced delivery: max random delay of the chunk
+    unsigned long long line_free; // paced delivery: virtual time when the last byte queued is over the wire
+    unsigned long rng; // deterministic random for jitter
+
+    int ready(); // number of bytes available by now
 
 public:
     test_Stream();
@@ -33,13 +42,16 @@ public:
     void add_input( std::string );
     void add_input( const char* );
     void clear();
+    void set_pacing( long, int = 1, unsigned long = 0 ); // baud, chunk size, max jitter in us. baud 0 turns pacing off
     int fail_percentage;
+    std::string output; // everything printed to the host
 
     // mockups
     void setTimeout(int);
     int  available();
     int  read();
     size_t readBytes(char*, int);
+    size_t write(uint8_t);
 
     template<typename T> void print(T p);
     template<typename T> void println(T p);
@@ -52,12 +64,21 @@ using Stream = test_Stream;
 using String = std::string;
 
 extern unsigned long millis();
+extern unsigned long micros();
+
+// simulated clock. time stands still until advanced
+extern unsigned long long virtual_ns;
+unsigned long virtual_micros();
+unsigned long virtual_millis();
+void advance_clock( unsigned long us );
+inline void yield() {}
 
 #if defined(_MSC_VER) || defined(__CYGWIN__)
 #include <windows.h>
 #define delay(a) Sleep((a))
 #else
 #include <stdlib.h>
+#include <unistd.h>
 #define delay(a) sleep((a)/1000 + 1)
 
 #endif
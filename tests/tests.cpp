@@ -15,6 +15,36 @@
 #include "test_Stream.hpp"
 #include "../include/host_command.hpp"
 
+#include <cstdlib>
+#include <new>
+
+// global heap use counters. everything in this program is counted, so take the difference around the code in question
+static size_t alloc_calls = 0;
+static size_t alloc_bytes = 0;
+
+void* operator new( size_t n )
+{
+    ++alloc_calls;
+    alloc_bytes += n;
+
+    void* p = malloc( n ? n : 1 );
+
+    if ( p == nullptr )
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void* operator new[]( size_t n )
+{
+    return operator new( n );
+}
+
+void operator delete( void* p ) noexcept { free( p ); }
+void operator delete[]( void* p ) noexcept { free( p ); }
+void operator delete( void* p, size_t ) noexcept { free( p ); }
+void operator delete[]( void* p, size_t ) noexcept { free( p ); }
+
 #if defined(_MSC_VER) || defined(__CYGWIN__)
 // arduino millis() emulation. for testing purposes we don't need to account for more than a minute of run time
 unsigned long millis()
@@ -25,6 +55,12 @@ unsigned long millis()
     return 60000ul * st.wMinute + 1000ul * st.wSecond + st.wMilliseconds;
 }
 
+// arduino micros() emulation. millisecond resolution is enough here
+unsigned long micros()
+{
+    return 1000ul * millis();
+}
+
 #else
 // non-windows mocks implementations
 #include <time.h>
@@ -34,7 +70,15 @@ unsigned long millis()
 {
     struct timespec tp;
     clock_gettime(CLOCK_MONOTONIC, &tp);
-    return (unsigned long)(tp.tv_sec * 1000ul + tp.tv_nsec / 1000l);
+    return (unsigned long)(tp.tv_sec * 1000ul + tp.tv_nsec / 1000000l);
+}
+
+// arduino micros() emulation
+unsigned long micros()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (unsigned long)(tp.tv_sec * 1000000ul + tp.tv_nsec / 1000l);
 }
 #endif
 
@@ -52,6 +96,7 @@ namespace {
         ~host_commandTest() override
         {
             Serial.clear();
+            Serial.set_pacing(0);
         }
 
         //void SetUp() override {}
@@ -77,6 +122,24 @@ namespace {
         EXPECT_FALSE( hc.new_command("C2") );
     }
 
+    //======================================================
+    // frames and records keep the command's index in a byte
+    TEST_F(host_commandTest, test_Too_Many_Commands)
+    {
+        host_command hc(8);
+        std::vector<std::string> names;
+
+        for (int i = 0; i < 256; ++i)
+            names.push_back("C" + std::to_string(i));
+
+        for (int i = 0; i < 255; ++i) // 255 is the stored sequence tag's marker
+            EXPECT_TRUE(hc.new_command(names[i].c_str()));
+
+        EXPECT_FALSE(hc.new_command(names[255].c_str()));
+        EXPECT_STREQ(hc.errstr(), "too many commands for one byte index");
+        EXPECT_EQ(hc.new_command(names[255].c_str(), "d"), -1);
+    }
+
     //======================================================
     TEST_F(host_commandTest, test_bad_Parameters)
     {
@@ -775,6 +838,2340 @@ namespace {
         EXPECT_EQ(hc.get_parameter_index(), 2);
         EXPECT_STREQ(hc.get_str(), "KL");
     }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Encoded_Binary_Params)
+    {
+        host_command hc(8, &Serial);
+
+        EXPECT_EQ(hc.new_command("hex", "x"), 1);
+        EXPECT_EQ(hc.new_command("b64", "m ?m"), 2);
+        EXPECT_EQ(hc.new_command("short", "2x"), 1);
+        EXPECT_EQ(hc.new_command("bad", "8x"), -1);
+
+        Serial.add_input("hex 00FFa5\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 3);
+        EXPECT_EQ(hc.get_blob()[0], 0x00);
+        EXPECT_EQ(hc.get_blob()[1], 0xff);
+        EXPECT_EQ(hc.get_blob()[2], 0xa5);
+
+        Serial.add_input("b64 SGVsbG8= aGk\n"); // "Hello" "hi"
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 5);
+        EXPECT_STREQ(hc.get_str(), "Hello");
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 2);
+        EXPECT_STREQ(hc.get_str(), "hi");
+        EXPECT_TRUE(hc.no_more_parameters());
+
+        // odd number of hex digits
+        Serial.add_input("hex 123\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        // bad chars
+        Serial.add_input("b64 SGV*bG8=\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        // decoded data is over the limit
+        Serial.add_input("short 010203\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 2);
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+    }
+
+    //======================================================
+    static std::string sink_data;
+    static int sink_calls;
+    static bool sink_got_last;
+
+    static void test_sink(host_command*, const uint8_t* data, int len, bool last)
+    {
+        sink_data.append((const char*)data, len);
+        ++sink_calls;
+        sink_got_last = last;
+    }
+
+    TEST_F(host_commandTest, test_Streamed_Binary_Params)
+    {
+        host_command hc(4, &Serial);
+
+        sink_data.clear();
+        sink_calls = 0;
+        sink_got_last = false;
+        hc.set_sink(test_sink);
+
+        EXPECT_EQ(hc.new_command("put", "d >m"), 2);
+        EXPECT_EQ(hc.new_command("bad", ">d"), -1);
+
+        // "The quick brown fox" is way longer than the buffer
+        Serial.add_input("put 7 VGhlIHF1aWNrIGJyb3duIGZveA==\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 7);
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_parameter_index(), 1);
+        EXPECT_EQ(hc.get_length(), 19);
+        EXPECT_EQ(sink_data, "The quick brown fox");
+        EXPECT_GT(sink_calls, 1);
+        EXPECT_TRUE(sink_got_last);
+        EXPECT_TRUE(hc.is_command_complete());
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Streamed_String_Params)
+    {
+        host_command hc(8, &Serial);
+
+        sink_data.clear();
+        sink_calls = 0;
+        hc.set_sink(test_sink);
+
+        EXPECT_EQ(hc.new_command("text", ">q >s"), 2);
+        EXPECT_EQ(hc.new_command("limited", ">3s d"), 2);
+
+        // quotes and escapes are spread across the chunks
+        Serial.add_input("text 'It\\'s \"quoted\"\\\\' long\\ escaped\\ word\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_parameter_index(), 0);
+        EXPECT_EQ(sink_data, "It's \"quoted\"\\");
+        EXPECT_EQ(hc.get_length(), 14);
+        EXPECT_TRUE(sink_got_last);
+
+        sink_data.clear();
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_parameter_index(), 1);
+        EXPECT_EQ(sink_data, "long escaped word");
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // length limit still holds across the chunks
+        sink_data.clear();
+        Serial.add_input("limited abcdef 42\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(sink_data, "abc");
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 42);
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Bulk_Receive)
+    {
+        host_command hc(16, &Serial);
+        char data[16];
+
+        EXPECT_EQ(hc.new_command("upload", "d"), 1);
+
+        Serial.add_input("upload 10\n0123");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 10);
+
+        EXPECT_TRUE(hc.begin_receive(data, hc.get_int()));
+        EXPECT_EQ(hc.poll_receive(), 0);
+        EXPECT_EQ(hc.get_received(), 4);
+
+        Serial.add_input("456789extra");
+        EXPECT_EQ(hc.poll_receive(), 1);
+        EXPECT_EQ(hc.get_received(), 10);
+        EXPECT_EQ(std::string(data, 10), "0123456789");
+
+        // the rest should be left alone
+        EXPECT_TRUE(hc.fill_buffer(data, 5));
+        EXPECT_EQ(std::string(data, 5), "extra");
+
+        // timeout
+        EXPECT_TRUE(hc.begin_receive(data, 5, 10));
+        Serial.add_input("12");
+
+        int rc;
+        unsigned long start = millis();
+
+        while ( (rc = hc.poll_receive()) == 0 && millis() - start < 1000 )
+            ;
+
+        EXPECT_EQ(rc, -1);
+        EXPECT_EQ(hc.get_received(), 2);
+        EXPECT_STREQ(hc.errstr(), "timed out");
+
+        hc.limit_time(10);
+        EXPECT_FALSE(hc.fill_buffer(data, 5));
+    }
+
+    //======================================================
+    static std::string consumed;
+    static int consumer_calls;
+    static bool consumer_releases;
+
+    static void test_consumer(host_command* hc, uint8_t* data, int len, bool last)
+    {
+        consumed.append((const char*)data, len);
+        ++consumer_calls;
+
+        if (consumer_releases)
+            hc->release_buffer();
+    }
+
+    TEST_F(host_commandTest, test_Double_Buffered_Receive)
+    {
+        host_command hc(16, &Serial);
+        char a[4], b[4];
+
+        consumed.clear();
+        consumer_calls = 0;
+        consumer_releases = true;
+
+        // synchronous consumer
+        EXPECT_TRUE(hc.begin_receive(a, b, 4, 10, test_consumer));
+        Serial.add_input("0123456");
+        EXPECT_EQ(hc.poll_receive(), 0);
+        EXPECT_EQ(consumer_calls, 1);
+
+        Serial.add_input("789");
+        EXPECT_EQ(hc.poll_receive(), 1);
+        EXPECT_EQ(consumer_calls, 3);
+        EXPECT_EQ(consumed, "0123456789");
+        EXPECT_EQ(hc.get_received(), 10);
+
+        // slow consumer: both buffers are held, so the rest should wait in the source
+        consumed.clear();
+        consumer_calls = 0;
+        consumer_releases = false;
+
+        EXPECT_TRUE(hc.begin_receive(a, b, 4, 12, test_consumer));
+        Serial.add_input("abcdefghijkl");
+        EXPECT_EQ(hc.poll_receive(), 0);
+        EXPECT_EQ(consumer_calls, 2);
+        EXPECT_EQ(hc.get_received(), 8);
+        EXPECT_EQ(Serial.available(), 4);
+
+        hc.release_buffer();
+        EXPECT_EQ(hc.poll_receive(), 0);
+        EXPECT_EQ(consumer_calls, 3);
+        EXPECT_EQ(consumed, "abcdefghijkl");
+
+        hc.release_buffer();
+        EXPECT_EQ(hc.poll_receive(), 0); // the last one is still held
+        hc.release_buffer();
+        EXPECT_EQ(hc.poll_receive(), 1);
+
+        // the timeout counts while the consumer holds both buffers or the last one
+        for (int total = 12; total >= 4; total -= 8)
+        {
+            consumer_calls = 0;
+
+            EXPECT_TRUE(hc.begin_receive(a, b, 4, total, test_consumer, 10));
+            Serial.add_input(std::string(total, 'x'));
+
+            int rc;
+            unsigned long start = millis();
+
+            while ( (rc = hc.poll_receive()) == 0 && millis() - start < 1000 )
+                ;
+
+            EXPECT_EQ(rc, -1);
+            EXPECT_EQ(consumer_calls, total == 12 ? 2 : 1);
+            EXPECT_STREQ(hc.errstr(), "timed out");
+
+            while (Serial.available() > 0)
+                Serial.read();
+        }
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Netstring_Params)
+    {
+        host_command hc(16, &Serial);
+
+        EXPECT_EQ(hc.new_command("put", "n d"), 2);
+        EXPECT_EQ(hc.new_command("short", "4n"), 1);
+
+        Serial.add_input("put #11:a b\nc\\ 'd\"e 42\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 11);
+        EXPECT_EQ(std::string((const char*)hc.get_blob(), hc.get_length()), "a b\nc\\ 'd\"e");
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 42);
+        EXPECT_TRUE(hc.is_command_complete());
+
+        // arriving in pieces, empty one
+        Serial.add_input("put #5:ab");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        Serial.add_input(std::string("c\0e 1\nput #0: 2\n", 16));
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 5);
+        EXPECT_EQ(std::string((const char*)hc.get_blob(), 5), std::string("abc\0e", 5));
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 1);
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 2);
+
+        // too long one is skipped as a whole, so the next command is fine
+        Serial.add_input("short #6:\nshort\nshort #4:1234\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "1234");
+
+        // bad prefixes
+        Serial.add_input("short 5:abcde\nshort #:\nshort #2x\n");
+
+        for (int i = 0; i < 3; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_FALSE(hc.has_next_parameter());
+            EXPECT_TRUE(hc.is_invalid_input());
+        }
+
+        // the delimiter or EOL after the data belongs to it
+        EXPECT_EQ(hc.new_command("opt", "n ?d d"), 3);
+
+        Serial.add_input("opt #3:abc\nopt #3:abc 7\nopt #0:\t5 6\n");
+
+        for (int i = 0; i < 2; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_EQ(hc.get_command_id(), 2);
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_STREQ(hc.get_str(), "abc");
+            EXPECT_EQ(hc.has_next_parameter(), i == 1);
+            EXPECT_FALSE(hc.is_invalid_input());
+            EXPECT_TRUE(hc.is_command_complete());
+
+            if (i == 1)
+            {
+                EXPECT_EQ(hc.get_int(), 7);
+                EXPECT_FALSE(hc.has_next_parameter());
+            }
+        }
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 5);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 6);
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // the data running into the next token is an error
+        Serial.add_input("put #2:abc 5\nput #1:x 9\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+        EXPECT_STREQ(hc.errstr(), "invalid length prefix of raw data");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "x");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 9);
+        EXPECT_TRUE(hc.is_command_complete());
+    }
+
+    //======================================================
+    static std::string cobs_encode(const std::string& data)
+    {
+        std::string out;
+        size_t code_pos = 0;
+
+        out += '\x01';
+
+        for (unsigned char c : data)
+        {
+            if (c == 0)
+            {
+                code_pos = out.size();
+                out += '\x01';
+                continue;
+            }
+
+            out += c;
+
+            if (++out[code_pos] == '\xff')
+            {
+                code_pos = out.size();
+                out += '\x01';
+            }
+        }
+
+        return out + '\0';
+    }
+
+    static std::string slip_encode(const std::string& data)
+    {
+        std::string out;
+
+        for (unsigned char c : data)
+        {
+            if (c == 0xC0)
+                out += "\xDB\xDC";
+            else if (c == 0xDB)
+                out += "\xDB\xDD";
+            else
+                out += c;
+        }
+
+        return out + '\xC0';
+    }
+
+    TEST_F(host_commandTest, test_Binary_Frames)
+    {
+        host_command hc(64, &Serial);
+
+        EXPECT_EQ(hc.new_command("ping"), true);
+        EXPECT_EQ(hc.new_command("set", "b c d f ?s x"), 6);
+
+        // set true 'A' -2 1.5 "on" [00 C0 DB]
+        std::string set(
+            "\x01" "\x01" "A" "\xfe\xff\xff\xff" "\x00\x00\xc0\x3f" "on\0" "\x03\x00" "\x00\xc0\xdb", 19);
+
+        hc.set_framing(hc_framing_cobs);
+        Serial.add_input(cobs_encode(std::string("\0", 1)) + cobs_encode(set));
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_STREQ(hc.get_command_name(), "ping");
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_TRUE(hc.no_more_parameters());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.get_bool());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_byte(), 'A');
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), -2);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FLOAT_EQ(hc.get_float(), 1.5f);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "on");
+        EXPECT_TRUE(hc.get_bool());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 3);
+        EXPECT_EQ(std::string((const char*)hc.get_blob(), 3), std::string("\x00\xc0\xdb", 3));
+        EXPECT_TRUE(hc.no_more_parameters());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // the same via SLIP, in pieces and with optional parameters omitted
+        hc.set_framing(hc_framing_slip);
+        std::string frame = slip_encode(set.substr(0, 11));
+
+        Serial.add_input(frame.substr(0, 5));
+        EXPECT_FALSE(hc.get_next_command());
+
+        Serial.add_input(frame.substr(5));
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+
+        for (int i = 0; i < 4; ++i)
+            EXPECT_TRUE(hc.has_next_parameter());
+
+        EXPECT_FLOAT_EQ(hc.get_float(), 1.5f);
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_TRUE(hc.no_more_parameters());
+        EXPECT_FALSE(hc.has_next_parameter());
+
+        // missing required field, unknown command and broken string
+        Serial.add_input(slip_encode(set.substr(0, 7)) + slip_encode("\x05") + slip_encode(set.substr(0, 13)) + slip_encode(std::string("\0", 1)));
+
+        EXPECT_TRUE(hc.get_next_command());
+        for (int i = 0; i < 3; ++i)
+            EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        for (int i = 0; i < 4; ++i)
+            EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_STREQ(hc.get_command_name(), "ping");
+
+        // bytes past the last field reject the frame before the command is reported
+        Serial.add_input(slip_encode(set + "X") + slip_encode(std::string("\0Z", 2)) + slip_encode(set));
+
+        for (int i = 0; i < 2; ++i)
+        {
+            EXPECT_FALSE(hc.get_next_command());
+            EXPECT_TRUE(hc.is_invalid_input());
+            EXPECT_STREQ(hc.errstr(), "malformed binary frame");
+        }
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        while (hc.has_next_parameter())
+            ;
+
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // back to text
+        hc.set_framing(hc_framing_text);
+        Serial.add_input("set 1 B 42 2.5\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        for (int i = 0; i < 3; ++i)
+            EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 42);
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Checksum)
+    {
+        host_command hc(64, &Serial);
+
+        EXPECT_EQ(hc.new_command("ping"), true);
+        EXPECT_EQ(hc.new_command("C1", "d"), 1);
+        EXPECT_EQ(hc.new_command("C2", "s d"), 2);
+        EXPECT_EQ(hc.new_command("C3", "q d"), 2);
+        EXPECT_EQ(hc.new_command("C4", "n d"), 2);
+
+        hc.set_checksum(hc_checksum_xor);
+        Serial.add_input("C1 123*62\nC1 124*62\nC1 5\nping *30\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 123);
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // wrong one
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        // missing one
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        // no parameters. complete only after the checksum
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_FALSE(hc.is_command_complete());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // the last parameter is not complete until the line is verified
+        Serial.add_input("C2 abc 42");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "abc");
+        EXPECT_FALSE(hc.is_command_complete());
+        EXPECT_FALSE(hc.has_next_parameter());
+
+        Serial.add_input(" *37\n");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 42);
+        EXPECT_FALSE(hc.is_command_complete());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_TRUE(hc.no_more_parameters());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // CRC16. '*' in quotes or escaped is data
+        hc.set_checksum(hc_checksum_crc16);
+        Serial.add_input("C3 \"a*b\" 7*C63B\nC2 a\\*b 7*a37e\nC1 123*AC4\nC1 123*AC43\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "a*b");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 7);
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "a*b");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 123);
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // raw CR and LF of netstring are summed too
+        hc.set_checksum(hc_checksum_xor);
+        Serial.add_input("C4 #4:a\r\nb 5*6B\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 4);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(std::string((const char*)hc.get_blob(), hc.get_length()), "a\r\nb");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 5);
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // blank lines, even with a checksum alone, do not spoil the next one
+        Serial.add_input("*00\n  \nC1 123*62\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 123);
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.is_command_complete());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // with the storage nothing of the corrupted line reaches the handler
+        uint8_t storage[64];
+
+        hc.set_checksum(hc_checksum_xor, storage, sizeof(storage));
+        Serial.add_input("C1 123*00\nC2 abc 42");
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_TRUE(hc.is_invalid_input());
+        EXPECT_STREQ(hc.errstr(), "missing or wrong checksum");
+        EXPECT_FALSE(hc.has_next_parameter());
+
+        EXPECT_FALSE(hc.get_next_command()); // not verified yet
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        Serial.add_input(" *37\nC1 5*67;C1 6*64\n");
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 2);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "abc");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 42);
+        EXPECT_TRUE(hc.is_command_complete());
+
+        for (int i = 5; i <= 6; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_EQ(hc.get_int(), i);
+        }
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_FALSE(hc.is_invalid_input());
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Sequence_Tags)
+    {
+        host_command hc(64, &Serial);
+
+        EXPECT_EQ(hc.new_command("ping"), true);
+        EXPECT_EQ(hc.new_command("C1", "d"), 1);
+        EXPECT_EQ(hc.new_command("C2", "s d"), 2);
+
+        hc.allow_sequence(true);
+        Serial.add_input("@1 C1 5\n@2 C2 abc\n@3 XX 1\nC1 7\n@4 ping\n@x ping\n@5 ping\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 5);
+        EXPECT_EQ(Serial.output, ""); // not done with it yet
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(Serial.output, "ACK 1\n");
+        EXPECT_EQ(hc.get_command_id(), 2);
+        EXPECT_FALSE(hc.has_next_parameter()); // the second one is missing
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        EXPECT_FALSE(hc.get_next_command()); // unknown one
+        EXPECT_EQ(Serial.output, "ACK 1\nNAK 2 4\n");
+
+        EXPECT_TRUE(hc.get_next_command()); // untagged one
+        EXPECT_EQ(Serial.output, "ACK 1\nNAK 2 4\nNAK 3 13\n");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 7);
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+
+        EXPECT_FALSE(hc.get_next_command()); // broken tag
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(Serial.output, "ACK 1\nNAK 2 4\nNAK 3 13\nACK 4\nACK 5\n");
+
+        // no tags - no replies
+        hc.allow_sequence(false);
+        Serial.output.clear();
+        Serial.add_input("@6 ping\nping\n");
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(Serial.output, "");
+    }
+
+    //======================================================
+    // the stored commands are ACK'ed when they are reported or dropped, not when stored
+    TEST_F(host_commandTest, test_Sequence_Stored)
+    {
+        host_command hc(32, &Serial);
+        uint8_t storage[200];
+
+        EXPECT_EQ(hc.new_command("ping"), true);
+        EXPECT_EQ(hc.new_command("C1", "d"), 1);
+        hc.coalesce_by(-1);
+
+        hc.allow_sequence(true);
+        hc.set_batch_buffer(storage, sizeof(storage));
+        Serial.add_input("BEGIN\n@1 C1 5\n@2 ping\ncommit\n");
+
+        EXPECT_FALSE(hc.get_next_command()); // BEGIN
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_EQ(Serial.output, ""); // stored only
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_EQ(Serial.output, "ACK 1\n");
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(Serial.output, "ACK 1\nACK 2\n");
+
+        // dropped batch NAKs all of them
+        Serial.output.clear();
+        Serial.add_input("BEGIN\n@3 C1 1\n@4 XX\n@5 ping\nCOMMIT\nBEGIN\n@6 ping\nABORT\n");
+
+        while (Serial.available() > 0)
+            EXPECT_FALSE(hc.get_next_command());
+
+        EXPECT_EQ(Serial.output, "NAK 4 13\nNAK 3 14\nNAK 5 14\nNAK 6 14\n");
+
+        // backlog: superseded one is ACK'ed as the newer does its job
+        Serial.output.clear();
+        hc.set_batch_buffer(nullptr, 0);
+        EXPECT_TRUE(hc.set_backlog(storage, sizeof(storage)));
+        Serial.add_input("@7 C1 1\n@8 C1 2\n@9 ping\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 2);
+        EXPECT_EQ(Serial.output, "ACK 7\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_EQ(Serial.output, "ACK 7\nACK 8\n");
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(Serial.output, "ACK 7\nACK 8\nACK 9\n");
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Separator)
+    {
+        host_command hc(64, &Serial);
+
+        EXPECT_EQ(hc.new_command("C1", "d"), 1);
+        EXPECT_EQ(hc.new_command("C2", "s d"), 2);
+        EXPECT_EQ(hc.new_command("C3", "d ? d"), 2);
+        EXPECT_EQ(hc.new_command("CQ", "q"), 1);
+
+        Serial.add_input("C1 1;C3 2;C3 3 4; C2 a\\;b 5;CQ \"x;y\";XX;C1 6\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 1);
+        EXPECT_TRUE(hc.no_more_parameters());
+
+        // optional one omitted
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 2);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 2);
+        EXPECT_TRUE(hc.no_more_parameters());
+        EXPECT_FALSE(hc.has_next_parameter());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 2);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 4);
+        EXPECT_TRUE(hc.no_more_parameters());
+
+        // escaped and quoted ones are data
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "a;b");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 5);
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 3);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "x;y");
+
+        // unknown command does not spoil the rest of the line
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_TRUE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 6);
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        hc.set_separator('\0');
+        Serial.add_input("C2 a;b 7\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "a;b");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 7);
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Batches)
+    {
+        host_command hc(64, &Serial);
+        uint8_t storage[64];
+
+        EXPECT_EQ(hc.new_command("C1", "d"), 1);
+        EXPECT_EQ(hc.new_command("C2", "s f"), 2);
+        EXPECT_EQ(hc.new_command("C3", "b ? q"), 2);
+
+        hc.set_batch_buffer(storage, sizeof(storage));
+        Serial.add_input("C1 1\nBEGIN\nC1 2\nC2 abc 1.5\nC3 on\nC3 no \"x y\"\ncommit\nC1 3\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 1);
+
+        EXPECT_FALSE(hc.get_next_command()); // BEGIN
+        EXPECT_TRUE(hc.is_batch_open());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        // all collected, then reported back-to-back
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.is_batch_open());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 2);
+        EXPECT_TRUE(hc.no_more_parameters());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "abc");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FLOAT_EQ(hc.get_float(), 1.5f);
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 2);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.get_bool());
+        EXPECT_TRUE(hc.no_more_parameters());
+        EXPECT_FALSE(hc.has_next_parameter());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 2);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FALSE(hc.get_bool());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "x y");
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 3);
+        EXPECT_FALSE(hc.get_next_command());
+
+        // one bad command drops the whole batch
+        Serial.add_input("BEGIN\nC1 5\nC1\nXX\ncommit\nC1 6\n");
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_FALSE(hc.get_next_command()); // XX
+        EXPECT_FALSE(hc.get_next_command()); // COMMIT
+        EXPECT_TRUE(hc.is_invalid_input());
+        EXPECT_STREQ(hc.errstr(), "batch has invalid commands or does not fit");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 6);
+
+        // abort
+        Serial.add_input("BEGIN\nC1 7\nABORT\nC1 8\n");
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_FALSE(hc.is_batch_open());
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 8);
+
+        // does not fit
+        hc.set_batch_buffer(storage, 12);
+        Serial.add_input("BEGIN\nC1 9\nC2 abcdef 1\ncommit\n");
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_TRUE(hc.is_invalid_input());
+        EXPECT_FALSE(hc.get_next_command());
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Compile_Replay)
+    {
+        host_command hc(64, &Serial);
+        test_Stream script;
+        uint8_t records[64];
+
+        EXPECT_EQ(hc.new_command("C1", "d"), 1);
+        EXPECT_EQ(hc.new_command("C2", "s f"), 2);
+        EXPECT_EQ(hc.new_command("C3", "b ? q"), 2);
+
+        Serial.add_input("C1 9\n");
+        script.add_input("C1 1\nC2 abc 2.5\n\n   C3 y\n");
+
+        // 3 + 4, 3 + 4 + 4, 3 + 1
+        EXPECT_EQ(hc.compile(&script, records, sizeof(records)), 22);
+
+        EXPECT_TRUE(hc.replay(records, 22));
+        EXPECT_FALSE(hc.replay(records, 22)); // busy
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 1);
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 1);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "abc");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FLOAT_EQ(hc.get_float(), 2.5f);
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 2);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.get_bool());
+        EXPECT_TRUE(hc.no_more_parameters());
+
+        // the usual source is next
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 9);
+        EXPECT_FALSE(hc.get_next_command());
+
+        // again
+        EXPECT_TRUE(hc.replay(records, 22));
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 1);
+
+        while (hc.get_next_command()) // the rest of it
+            ;
+
+        // errors
+        script.clear();
+        script.add_input("C1 1\nXX 2\n");
+        EXPECT_EQ(hc.compile(&script, records, sizeof(records)), -1);
+        EXPECT_STREQ(hc.errstr(), "unknown command");
+
+        script.clear();
+        script.add_input("C2 abc\n");
+        EXPECT_EQ(hc.compile(&script, records, sizeof(records)), -1);
+
+        script.clear();
+        script.add_input("C1 1\nC1 2\n");
+        EXPECT_EQ(hc.compile(&script, records, 10), -1);
+
+        // in the middle of the live command, with the live settings far from the defaults
+        hc.set_checksum(hc_checksum_xor);
+        hc.set_separator(',');
+        Serial.add_input("C2 abc 2");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_STREQ(hc.get_str(), "abc");
+        EXPECT_FALSE(hc.has_next_parameter());
+
+        script.clear();
+        script.add_input("C1 1;C1 2\n");
+        EXPECT_EQ(hc.compile(&script, records, sizeof(records)), 14);
+
+        Serial.add_input(".5*38\nC1 3*61,C1 4*66\n"); // the same separator and the checksum go on
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FLOAT_EQ(hc.get_float(), 2.5f);
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        for (int i = 3; i <= 4; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_EQ(hc.get_command_id(), 0);
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_EQ(hc.get_int(), i);
+            EXPECT_FALSE(hc.has_next_parameter());
+            EXPECT_FALSE(hc.is_invalid_input());
+        }
+
+        EXPECT_TRUE(hc.replay(records, 14));
+
+        for (int i = 1; i <= 2; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_EQ(hc.get_int(), i);
+        }
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Line_Cache)
+    {
+        host_command hc(32, &Serial);
+        uint8_t storage[32 + 4 * 26];
+
+        EXPECT_EQ(hc.new_command("LED", "d b"), 2);
+        EXPECT_EQ(hc.new_command("GET"), true);
+        EXPECT_EQ(hc.new_command("C2", "s d"), 2);
+        EXPECT_EQ(hc.new_command("S", "s"), 1);
+
+        EXPECT_FALSE(hc.set_line_cache(storage, 32 + 4 * 8, 4)); // slots are too small
+        EXPECT_TRUE(hc.set_line_cache(storage, sizeof(storage), 4));
+
+        Serial.add_input("LED 3 on\nGET\nLED 3 on\nLED 3 on\nGET\nLED 4 off\nLED 3 on\r\n");
+
+        for (int i = 0; i < 7; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+
+            if (hc.get_command_id() == 1)
+                continue;
+
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_EQ(hc.get_int(), i == 5 ? 4 : 3);
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_EQ(hc.get_bool(), i != 5);
+            EXPECT_TRUE(hc.no_more_parameters());
+        }
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(hc.get_cache_hits(), 4UL);
+        EXPECT_EQ(hc.get_cache_misses(), 3UL);
+
+        // too long for the slot, several commands and an incomplete one are not cached
+        Serial.add_input("C2 abcdefghijk 5\nC2 abcdefghijk 5\nLED 1 on;GET\nLED 1 on;GET\nLED 1\nLED 1\n");
+
+        for (int i = 0; i < 2; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_STREQ(hc.get_str(), "abcdefghijk");
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_EQ(hc.get_int(), 5);
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_TRUE(hc.get_bool());
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_EQ(hc.get_command_id(), 1);
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_FALSE(hc.has_next_parameter());
+            EXPECT_TRUE(hc.is_invalid_input());
+        }
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(hc.get_cache_hits(), 4UL);
+        EXPECT_EQ(hc.get_cache_misses(), 9UL);
+
+        // the oldest entries are replaced first, so LED 3 and LED 4 off are gone
+        Serial.add_input("LED 5 on\nLED 6 on\nLED 3 on\nGET\nLED 5 on\nLED 6 on\n");
+
+        for (int i = 0; i < 6; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+
+            while (hc.has_next_parameter())
+                ;
+
+            if (i == 3)
+            {
+                EXPECT_EQ(hc.get_cache_hits(), 4UL);
+                EXPECT_EQ(hc.get_cache_misses(), 13UL);
+            }
+        }
+
+        EXPECT_EQ(hc.get_cache_hits(), 6UL);
+        EXPECT_EQ(hc.get_cache_misses(), 13UL);
+
+        // the same length and FNV-1a hash, but a different line
+        Serial.add_input("S aglbvs\nS ayacxa\nS aglbvs\n");
+
+        const char* expected[] = { "aglbvs", "ayacxa", "aglbvs" };
+
+        for (int i = 0; i < 3; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_EQ(hc.get_command_id(), 3);
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_STREQ(hc.get_str(), expected[i]);
+            EXPECT_TRUE(hc.no_more_parameters());
+        }
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(hc.get_cache_hits(), 7UL);
+        EXPECT_EQ(hc.get_cache_misses(), 15UL);
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Coalescing)
+    {
+        host_command hc(32, &Serial);
+        uint8_t storage[200];
+
+        EXPECT_EQ(hc.new_command("RGB", "s d d d"), 4);
+        hc.coalesce_by(0);
+        EXPECT_EQ(hc.new_command("SPEED", "d"), 1);
+        hc.coalesce_by(-1);
+        EXPECT_EQ(hc.new_command("LOG", "s"), 1);
+
+        EXPECT_FALSE(hc.set_backlog(storage, 98));
+        EXPECT_TRUE(hc.set_backlog(storage, sizeof(storage)));
+
+        Serial.add_input("RGB led1 1 2 3\nRGB led2 4 5 6\nLOG a\nRGB led1 7 8 9\nSPEED 10\nSPEED 20;SPEED 30\nLOG a\nRGB led1 1");
+
+        const char* names[] = { "RGB", "LOG", "RGB", "SPEED", "LOG" };
+        int values[] = { 4, 0, 7, 30, 0 };
+
+        for (int i = 0; i < 5; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_STREQ(hc.get_command_name(), names[i]);
+            EXPECT_TRUE(hc.has_next_parameter());
+
+            if (values[i] == 0)
+            {
+                EXPECT_STREQ(hc.get_str(), "a");
+            }
+            else if (i == 3)
+            {
+                EXPECT_EQ(hc.get_int(), values[i]);
+            }
+            else
+            {
+                EXPECT_STREQ(hc.get_str(), i == 0 ? "led2" : "led1");
+                EXPECT_TRUE(hc.has_next_parameter());
+                EXPECT_EQ(hc.get_int(), values[i]);
+                EXPECT_TRUE(hc.has_next_parameter());
+                EXPECT_TRUE(hc.has_next_parameter());
+                EXPECT_EQ(hc.get_int(), values[i] + 2);
+            }
+
+            EXPECT_FALSE(hc.has_next_parameter());
+        }
+
+        EXPECT_FALSE(hc.get_next_command()); // the last line is not complete yet
+
+        Serial.add_input(" 1 1\nFOO\nRGB led1 2 2 2\n");
+
+        EXPECT_FALSE(hc.get_next_command()); // errors are reported as soon as they are found
+        EXPECT_TRUE(hc.is_invalid_input());
+        EXPECT_TRUE(hc.get_next_command()); // RGB led1 1 1 1 is superseded
+        EXPECT_STREQ(hc.get_command_name(), "RGB");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 2);
+        EXPECT_FALSE(hc.get_next_command());
+
+        // the rest of input waits while backlog is full
+        EXPECT_TRUE(hc.set_backlog(storage, 99));
+
+        for (int i = 0; i < 10; ++i)
+            Serial.add_input("LOG abcde" + std::to_string(i) + "\n");
+
+        for (int i = 0; i < 10; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_EQ(hc.get_str(), "abcde" + std::to_string(i));
+
+            if (i == 0)
+            {
+                EXPECT_GT(Serial.available(), 0);
+            }
+        }
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(Serial.available(), 0);
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Priority)
+    {
+        host_command hc(32, &Serial);
+        uint8_t storage[300];
+
+        EXPECT_EQ(hc.new_command("TELE", "d"), 1);
+        EXPECT_EQ(hc.new_command("MODE", "d"), 1);
+        hc.set_priority(1);
+        EXPECT_TRUE(hc.new_command("ESTOP"));
+        hc.set_priority(9);
+
+        EXPECT_TRUE(hc.set_backlog(storage, sizeof(storage)));
+
+        Serial.add_input("TELE 1\nTELE 2\nTELE 3;MODE 1\nTELE 4\nESTOP\nMODE 2\nTELE 5\n");
+
+        const char* names[] = { "ESTOP", "MODE", "MODE", "TELE", "TELE", "TELE", "TELE", "TELE" };
+        int values[] = { 0, 1, 2, 1, 2, 3, 4, 5 };
+
+        for (int i = 0; i < 8; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_STREQ(hc.get_command_name(), names[i]);
+
+            if (i > 0)
+            {
+                EXPECT_TRUE(hc.has_next_parameter());
+                EXPECT_EQ(hc.get_int(), values[i]);
+            }
+        }
+
+        EXPECT_FALSE(hc.get_next_command());
+
+        // worst case: the flood doesn't fit into backlog. ESTOP waits until the lines before it are read ahead
+        EXPECT_TRUE(hc.set_backlog(storage, 99)); // room for 7 TELE commands
+
+        for (int i = 10; i < 40; ++i)
+            Serial.add_input("TELE " + std::to_string(i) + "\n");
+
+        Serial.add_input("ESTOP\n");
+
+        int reported = 0;
+
+        while (hc.get_next_command() && hc.get_command_id() == 0)
+            ++reported;
+
+        EXPECT_STREQ(hc.get_command_name(), "ESTOP");
+        EXPECT_EQ(reported, 30 - 7); // it got in together with the last TELE
+
+        for (int i = 0; i < 7; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            EXPECT_TRUE(hc.has_next_parameter());
+            EXPECT_EQ(hc.get_int(), 33 + i);
+        }
+
+        EXPECT_FALSE(hc.get_next_command());
+    }
+
+    //======================================================
+    // the raw data after the command's line is not for read ahead
+    TEST_F(host_commandTest, test_Backlog_Raw_Data)
+    {
+        host_command hc(32, &Serial);
+        uint8_t storage[200];
+        char data[4];
+
+        EXPECT_EQ(hc.new_command("UPLOAD", "d"), 1);
+        hc.set_data_follows();
+        EXPECT_EQ(hc.new_command("LED", "d b"), 2);
+        EXPECT_TRUE(hc.set_backlog(storage, sizeof(storage)));
+
+        Serial.add_input("LED 2 off\nUPLOAD 4\nWXYZ\nLED 1 on\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_STREQ(hc.get_command_name(), "LED");
+        EXPECT_EQ(Serial.available(), 14); // "WXYZ" and the rest wait
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_STREQ(hc.get_command_name(), "UPLOAD");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 4);
+        EXPECT_TRUE(hc.fill_buffer(data, 4));
+        EXPECT_EQ(std::string(data, 4), "WXYZ");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_STREQ(hc.get_command_name(), "LED");
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 1);
+        EXPECT_FALSE(hc.is_invalid_input());
+        EXPECT_FALSE(hc.get_next_command());
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Work_Budget)
+    {
+        host_command hc(32, &Serial);
+
+        EXPECT_EQ(hc.new_command("LED", "d b"), 2);
+        EXPECT_EQ(hc.new_command("NAME", "q"), 1);
+
+        hc.limit_work(2, 0);
+        Serial.add_input("LED 3 on\nNAME \"some name\"\n");
+
+        EXPECT_FALSE(hc.get_next_command()); // "LE"
+        EXPECT_EQ(Serial.available(), 24);
+        EXPECT_TRUE(hc.get_next_command()); // "D "
+        EXPECT_STREQ(hc.get_command_name(), "LED");
+        EXPECT_TRUE(hc.has_next_parameter()); // "3 "
+        EXPECT_EQ(hc.get_int(), 3);
+        EXPECT_FALSE(hc.has_next_parameter()); // "on" is not complete until EOL
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.get_bool());
+
+        int calls = 0;
+
+        while (!hc.get_next_command())
+            ++calls;
+
+        EXPECT_EQ(calls, 2);
+
+        for (calls = 1; !hc.has_next_parameter(); ++calls)
+            ;
+
+        EXPECT_EQ(calls, 6); // 2 bytes per call
+        EXPECT_STREQ(hc.get_str(), "some name");
+
+        // time budget is big enough for all
+        hc.limit_work(0, 1000000L);
+        Serial.add_input("LED 4 off\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 4);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_FALSE(hc.get_bool());
+        EXPECT_EQ(Serial.available(), 0);
+
+        // the command cut by the budget is not a new one: its parameters are not lost
+        hc.limit_work(4, 0);
+        Serial.add_input("LED 12345 on\n");
+
+        EXPECT_TRUE(hc.get_next_command()); // "LED "
+        EXPECT_FALSE(hc.has_next_parameter()); // "1234"
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(hc.get_command_id(), 0);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 12345);
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.get_bool());
+
+        // the loop from README
+        std::string got;
+        Serial.add_input("LED 12345 on\nNAME \"some name\"\nLED 6 off\n");
+
+        for (int i = 0; i < 50; ++i)
+        {
+            if (hc.no_more_parameters())
+            {
+                if (!hc.get_next_command())
+                    continue;
+
+                got += std::string(hc.get_command_name()) + ":";
+            }
+
+            if (!hc.has_next_parameter())
+                continue;
+
+            if (hc.get_command_id() == 1)
+                got += std::string(hc.get_str()) + ";";
+            else if (hc.get_parameter_index() == 0)
+                got += std::to_string(hc.get_int()) + ";";
+            else
+                got += std::string(hc.get_bool() ? "on" : "off") + ";";
+        }
+
+        EXPECT_EQ(got, "LED:12345;on;NAME:some name;LED:6;off;");
+    }
+
+    //======================================================
+    static unsigned long fake_now;
+    static unsigned long fake_step;
+
+    static unsigned long fake_clock()
+    {
+        unsigned long now = fake_now;
+
+        fake_now += fake_step;
+
+        return now;
+    }
+
+    TEST_F(host_commandTest, test_Clock)
+    {
+        host_command hc(128, &Serial);
+        char data[10];
+
+        hc.set_clock(fake_clock, 1); // ticks are milliseconds
+
+        // bulk read timeout across the clock's overflow
+        fake_now = ULONG_MAX - 5;
+        fake_step = 0;
+
+        EXPECT_TRUE(hc.begin_receive(data, 5, 10));
+        Serial.add_input("12");
+        EXPECT_EQ(hc.poll_receive(), 0);
+        fake_now += 9;
+        EXPECT_EQ(hc.poll_receive(), 0);
+        fake_now += 1;
+        EXPECT_EQ(hc.poll_receive(), -1);
+        EXPECT_STREQ(hc.errstr(), "timed out");
+        EXPECT_EQ(hc.get_received(), 2);
+
+        // max_time: every clock reading takes 1 ms now, and the clock is read once per 16 bytes
+        EXPECT_EQ(hc.new_command("S", "s"), 1);
+
+        fake_now = ULONG_MAX - 1;
+        fake_step = 1;
+        hc.limit_time(3);
+        Serial.add_input("S " + std::string(100, 'x') + "\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_EQ(Serial.available(), 101 - 16 * 3 + 1); // the 48th is not read
+
+        hc.limit_time(-1);
+        EXPECT_TRUE(hc.has_next_parameter()); // picks up where it stopped
+        EXPECT_EQ(hc.get_length(), 100);
+
+        // time budget per call
+        hc.limit_work(0, 2500); // 3 ticks
+        Serial.add_input("S " + std::string(100, 'x') + "\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_FALSE(hc.has_next_parameter());
+        EXPECT_EQ(Serial.available(), 101 - 16 * 3);
+
+        while (!hc.has_next_parameter())
+            ;
+
+        EXPECT_EQ(hc.get_length(), 100);
+
+        // binary frames keep to max_time too
+        hc.limit_work(0, 0);
+        hc.limit_time(3);
+        hc.set_framing(hc_framing_slip);
+        fake_step = 1;
+        Serial.add_input(slip_encode(std::string("\0", 1) + std::string(100, 'x') + std::string("\0", 1)));
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_GT(Serial.available(), 0);
+        EXPECT_FALSE(hc.is_invalid_input());
+
+        hc.limit_time(-1);
+        EXPECT_TRUE(hc.get_next_command()); // picks up where it stopped
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_length(), 100);
+
+        hc.set_framing(hc_framing_text);
+        hc.set_clock(nullptr, 0); // default one
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Paced_Latency)
+    {
+        host_command hc(32, &Serial);
+
+        EXPECT_EQ(hc.new_command("LED", "d b"), 2);
+        hc.set_clock(virtual_micros, 1000);
+
+        // polling every 10 us, like a busy control loop. returns the time from the start of sending to the last parameter
+        auto latency = [&](long baud, int chunk, unsigned long jitter) -> unsigned long
+        {
+            Serial.clear();
+            Serial.set_pacing(baud, chunk, jitter);
+
+            unsigned long start = virtual_micros();
+
+            Serial.add_input("LED 3 on\n");
+
+            while (!hc.get_next_command())
+                advance_clock(10);
+
+            for (int i = 0; i < 2; ++i)
+            {
+                while (!hc.has_next_parameter())
+                    advance_clock(10);
+            }
+
+            EXPECT_TRUE(hc.get_bool());
+
+            return virtual_micros() - start;
+        };
+
+        // 9 bytes, 10 bits each
+        EXPECT_EQ(latency(9600, 1, 0), 9380ul);
+        EXPECT_EQ(latency(115200, 1, 0), 790ul);
+        EXPECT_EQ(latency(2000000, 1, 0), 50ul);
+
+        // the whole line in one chunk, delayed randomly, but the same way every time
+        unsigned long jittered = latency(115200, 16, 100);
+
+        EXPECT_GE(jittered, 790ul);
+        EXPECT_LT(jittered, 890ul);
+        EXPECT_EQ(latency(115200, 16, 100), jittered);
+
+        // bulk read timeout on the slow line: a byte takes 33 ms
+        char data[5];
+        int rc;
+
+        Serial.clear();
+        Serial.set_pacing(300);
+        Serial.add_input("12345");
+        EXPECT_TRUE(hc.begin_receive(data, 5, 10));
+
+        while ((rc = hc.poll_receive()) == 0)
+            advance_clock(100);
+
+        EXPECT_EQ(rc, -1);
+        EXPECT_EQ(hc.get_received(), 0);
+
+        Serial.clear();
+        Serial.set_pacing(9600);
+        Serial.add_input("12345");
+        EXPECT_TRUE(hc.begin_receive(data, 5, 10));
+
+        while ((rc = hc.poll_receive()) == 0)
+            advance_clock(100);
+
+        EXPECT_EQ(rc, 1);
+        EXPECT_EQ(std::string(data, 5), "12345");
+    }
+
+    //======================================================
+    // parse everything available the way a sketch does. no gtest macros inside, as they may allocate
+    static long parse_all(host_command& hc)
+    {
+        long sum = 0;
+
+        for (int idle = 0; idle < 3; )
+        {
+            if (!hc.get_next_command())
+            {
+                if (Serial.available() == 0)
+                    ++idle;
+
+                continue;
+            }
+
+            sum += hc.get_command_id() + strlen(hc.get_command_name());
+
+            while (hc.has_next_parameter())
+            {
+                uint32_t info = hc.get_parameter_info();
+
+                sum += hc.get_parameter_index() + hc.get_length() + hc.is_optional();
+
+                if (info & (hcmd_t_str | hcmd_t_qstr))
+                    sum += strlen(hc.get_str());
+                else if (info & hcmd_t_blob)
+                    sum += hc.get_blob()[0];
+                else if (info & hcmd_t_float)
+                    sum += static_cast<long>(hc.get_float());
+                else
+                    sum += hc.get_int() + hc.get_bool() + hc.get_byte();
+            }
+
+            sum += hc.is_command_complete() + hc.is_invalid_input() + hc.no_more_parameters();
+        }
+
+        return sum;
+    }
+
+    static long alloc_sink_sum;
+
+    static void alloc_sink(host_command*, const uint8_t* data, int len, bool)
+    {
+        for (int i = 0; i < len; ++i)
+            alloc_sink_sum += data[i];
+    }
+
+    TEST_F(host_commandTest, test_No_Allocations)
+    {
+        host_command hc(64, &Serial);
+        size_t calls = alloc_calls;
+        size_t bytes = alloc_bytes;
+        const char* specs[] = { "d b", "s32 ?d", "q f f", "x16", "m16 c", "n16", "", "s s s s s s s s", "c ?c", "d", ">s" };
+        const char* names[] = { "LED", "NAME", "SAY", "HEX", "B64", "RAW", "GET", "MANY", "CFG", "SET", "LOG" };
+
+        // registration: the command, its parameters and the commands table growth only
+        for (int i = 0; i < 11; ++i)
+            hc.new_command(names[i], specs[i]);
+
+        EXPECT_LE(alloc_calls - calls, 2u * 11 + 5);
+        EXPECT_LE(alloc_bytes - bytes, 11 * (sizeof(host_command_element) + 4 * 16) + 32 * sizeof(void*));
+
+        // long randomized input with all kinds of valid and broken lines
+        std::string input;
+        unsigned seed = 12345;
+        auto rnd = [&seed](unsigned n) { seed = seed * 1103515245u + 12345u; return (seed >> 8) % n; };
+
+        for (int i = 0; i < 20000; ++i)
+        {
+            switch (rnd(14))
+            {
+                case 0: input += "LED " + std::to_string(rnd(100)) + (rnd(2) ? " on" : " off"); break;
+                case 1: input += "NAME " + std::string(rnd(40), 'a' + rnd(26)) + (rnd(2) ? " 5" : ""); break;
+                case 2: input += "SAY \"x \\\"y\\\" \\\\z\" 1.5 -" + std::to_string(rnd(1000)) + ".25"; break;
+                case 3: input += "HEX " + std::string(2 * (1 + rnd(20)), "0123456789abcdefg"[rnd(17)]); break;
+                case 4: input += "B64 QUJD" + std::string(rnd(3) * 4, 'Q') + " " + std::to_string(rnd(300)); break;
+                case 5: input += "RAW #" + std::to_string(rnd(20)) + ":" + std::string(10, 'r'); break;
+                case 6: input += "GET;GET ; LED 1 1"; break;
+                case 7: input += "MANY a b c d e f g h"; break;
+                case 8: input += "BOGUS " + std::to_string(rnd(10)); break;
+                case 9: input += "SET " + std::string(rnd(10), '9') + "x"; break;
+                case 10: input += "BEGIN\nSET 1\nSET 2\n" + std::string(rnd(2) ? "COMMIT" : "ABORT"); break;
+                case 11: input += rnd(2) ? "SET 7" : "LOG " + std::string(rnd(200), 'l'); break;
+                case 12: input += std::string(rnd(100), ' ') + "\t"; break;
+                default: for (unsigned n = rnd(30); n > 0; --n) input += static_cast<char>(1 + rnd(254)); break;
+            }
+
+            input += rnd(5) ? "\n" : "\r\n";
+        }
+
+        uint8_t batch[256], cache[64 + 8 * 32], backlog[512];
+
+        // plain, cached, read ahead
+        for (int mode = 0; mode < 3; ++mode)
+        {
+            hc.set_batch_buffer(batch, sizeof(batch));
+            hc.set_line_cache(mode == 1 ? cache : nullptr, sizeof(cache), 8);
+            EXPECT_TRUE(hc.set_backlog(mode == 2 ? backlog : nullptr, sizeof(backlog)));
+            hc.discard();
+            Serial.clear();
+            Serial.add_input(input);
+
+            calls = alloc_calls;
+            bytes = alloc_bytes;
+
+            long sum = parse_all(hc);
+
+            EXPECT_EQ(alloc_calls - calls, 0u) << "mode " << mode;
+            EXPECT_EQ(alloc_bytes - bytes, 0u) << "mode " << mode;
+            EXPECT_NE(sum, 0);
+        }
+
+        // binary frames, valid and broken ones
+        std::string slip, cobs;
+        auto le32 = [](unsigned v) { return std::string{ char(v), char(v >> 8), char(v >> 16), char(v >> 24) }; };
+
+        for (int i = 0; i < 5000; ++i)
+        {
+            std::string f;
+
+            switch (rnd(6))
+            {
+                case 0: f = std::string(1, '\0') + le32(rnd(1000)) + "\x01"; break;
+                case 1: f = "\x01name" + std::string(1, '\0') + le32(5); break;
+                case 2: f = "\x06"; break;
+                case 3: f = "\x09" + le32(rnd(100)) + (rnd(4) ? "" : "x"); break;
+                case 4: f = std::string("\x03\x02\x00", 3) + char(rnd(256)) + char(rnd(256)); break;
+                default: for (unsigned n = 1 + rnd(10); n > 0; --n) f += static_cast<char>(rnd(256)); break;
+            }
+
+            slip += slip_encode(f);
+            cobs += cobs_encode(f);
+        }
+
+        // checksums and sequence tags, some of them broken
+        std::string tagged;
+
+        for (int i = 0; i < 5000; ++i)
+        {
+            std::string line = rnd(2) ? "@" + std::to_string(i) + " " : "";
+            line += rnd(2) ? "LED " + std::to_string(rnd(100)) + " on" : "SET " + std::to_string(rnd(100));
+
+            unsigned x = 0;
+
+            for (char c : line)
+                x ^= static_cast<uint8_t>(c);
+
+            char sum[8];
+            snprintf(sum, sizeof(sum), "*%02X", rnd(8) ? x : x ^ 1);
+            tagged += line + sum + "\n";
+        }
+
+        // stored records to replay
+        test_Stream script;
+        uint8_t records[64];
+
+        script.add_input("LED 1 on\nSET 5\nNAME abc 3\n");
+        long records_len = hc.compile(&script, records, sizeof(records));
+        EXPECT_GT(records_len, 0);
+
+        uint8_t hold[128], trace[hc_trace_header + 64 * hc_trace_event];
+        uint32_t hist[4 * hc_latency_phases * hc_latency_buckets];
+
+        hc.set_batch_buffer(batch, sizeof(batch));
+        hc.set_line_cache(nullptr, 0, 0);
+        EXPECT_TRUE(hc.set_backlog(nullptr, 0));
+        hc.set_sink(alloc_sink);
+        EXPECT_TRUE(hc.set_histograms(hist, sizeof(hist) / sizeof(hist[0])));
+        EXPECT_TRUE(hc.set_trace(trace, sizeof(trace)));
+        hc.limit_rate(100, 1);
+
+        // SLIP, COBS, checksum with and without holding, replay with streamed parameters
+        for (int mode = 0; mode < 5; ++mode)
+        {
+            hc.set_framing(mode == 0 ? hc_framing_slip : mode == 1 ? hc_framing_cobs : hc_framing_text);
+            hc.set_checksum(mode == 2 || mode == 3 ? hc_checksum_xor : hc_checksum_none, mode == 2 ? hold : nullptr, sizeof(hold));
+            hc.allow_sequence(mode == 2 || mode == 3);
+            hc.discard();
+            Serial.clear();
+            Serial.add_input(mode == 0 ? slip : mode == 1 ? cobs : mode < 4 ? tagged : input);
+            Serial.output.reserve(1 << 20); // ACK and NAK replies
+            alloc_sink_sum = 0;
+
+            calls = alloc_calls;
+            bytes = alloc_bytes;
+
+            if (mode == 4)
+                hc.replay(records, records_len);
+
+            long sum = parse_all(hc);
+
+            EXPECT_EQ(alloc_calls - calls, 0u) << "mode " << mode;
+            EXPECT_EQ(alloc_bytes - bytes, 0u) << "mode " << mode;
+            EXPECT_NE(sum, 0);
+
+            if (mode == 2 || mode == 3)
+            {
+                EXPECT_NE(Serial.output.find("ACK "), std::string::npos);
+                EXPECT_NE(Serial.output.find("NAK "), std::string::npos);
+            }
+
+            if (mode == 4)
+            {
+                EXPECT_NE(alloc_sink_sum, 0);
+            }
+        }
+
+        EXPECT_NE(hc.get_histogram(0, hc_latency_name), nullptr);
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Stats)
+    {
+        host_command hc(16, &Serial);
+        std::string input = "LED 3 on\nBOGUS 1\nLED 4 off\nLED 12345678901234567890 on\n";
+
+        EXPECT_EQ(hc.new_command("LED", "d b"), 2);
+        EXPECT_EQ(hc.new_command("GET", ""), 0);
+        Serial.add_input(input);
+
+        while (Serial.available() > 0)
+            if (hc.get_next_command())
+                while (hc.has_next_parameter())
+                    ;
+
+        EXPECT_FALSE(hc.get_next_command());
+
+        host_command_stats st = hc.get_stats();
+
+        EXPECT_EQ(st.bytes, input.length());
+        EXPECT_EQ(st.commands, 3u);
+        EXPECT_EQ(st.params, 4u);
+        EXPECT_EQ(st.invalid, 2u); // unknown command and the too long one
+        EXPECT_EQ(st.overflows, 1u);
+        EXPECT_EQ(st.timeouts, 0u);
+        EXPECT_EQ(st.errors[13], 1u); // unknown command
+        EXPECT_EQ(st.errors[6], 1u); // too long
+        EXPECT_EQ(st.errors[0], 0u);
+        EXPECT_EQ(hc.get_command_stats(0), 3u);
+        EXPECT_EQ(hc.get_command_stats(1), 0u);
+        EXPECT_EQ(hc.get_command_stats(2), 0u);
+        EXPECT_EQ(hc.get_command_stats(-1), 0u);
+
+        // processing time is out
+        fake_now = 0;
+        fake_step = 1000;
+        hc.set_clock(fake_clock, 1);
+        hc.limit_time(5);
+        Serial.add_input(std::string(40, ' ') + "GET\n");
+
+        while (!hc.get_next_command())
+            ;
+
+        EXPECT_STREQ(hc.get_command_name(), "GET");
+        EXPECT_EQ(hc.get_command_stats(1), 1u);
+        EXPECT_GE(hc.get_stats().timeouts, 1u);
+
+        hc.reset_stats();
+        st = hc.get_stats();
+
+        EXPECT_EQ(st.bytes + st.commands + st.params + st.invalid + st.overflows + st.timeouts + st.errors[13], 0u);
+        EXPECT_EQ(hc.get_command_stats(0), 0u);
+
+        // the definition errors are not the input's
+        EXPECT_EQ(hc.new_command("LED", "d"), -1);
+        EXPECT_EQ(hc.get_stats().errors[3], 0u);
+        EXPECT_EQ(hc.new_command("SET", "d d d d d d d d d d"), 10);
+
+        // the command that does not fit into backlog is the too long line, not the bad batch
+        uint8_t storage[51];
+
+        hc.limit_time(0);
+        EXPECT_TRUE(hc.set_backlog(storage, sizeof(storage)));
+        Serial.add_input("SET 1 2 3 4 5 6 7 8 9 10\nGET\n");
+
+        bool got = false;
+
+        for (int i = 0; i < 10 && !got; ++i)
+            got = hc.get_next_command();
+
+        EXPECT_TRUE(got);
+        EXPECT_STREQ(hc.get_command_name(), "GET");
+
+        st = hc.get_stats();
+        EXPECT_EQ(st.overflows, 1u);
+        EXPECT_EQ(st.errors[6], 1u);
+        EXPECT_EQ(st.errors[14], 0u);
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Histograms)
+    {
+        host_command hc(32, &Serial);
+        uint32_t store[2 * hc_latency_phases * hc_latency_buckets];
+
+        EXPECT_EQ(hc.new_command("LED", "d b"), 2);
+        EXPECT_EQ(hc.new_command("GET", ""), 0);
+
+        EXPECT_FALSE(hc.set_histograms(store, hc_latency_phases * hc_latency_buckets - 1));
+        EXPECT_EQ(hc.get_histogram(0, hc_latency_name), nullptr);
+        EXPECT_TRUE(hc.set_histograms(store, sizeof(store) / sizeof(store[0])));
+        EXPECT_EQ(hc.get_histogram(2, hc_latency_name), nullptr); // no such command
+        EXPECT_EQ(hc.get_histogram(0, hc_latency_phases), nullptr);
+
+        fake_step = 0;
+        fake_now = 100;
+        hc.set_clock(fake_clock, 1);
+
+        Serial.add_input("  LE"); // the first byte is 'L'
+        EXPECT_FALSE(hc.get_next_command());
+
+        fake_now = 105;
+        Serial.add_input("D 3 on\n");
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 3);
+
+        fake_now = 110;
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_TRUE(hc.get_bool());
+
+        fake_now = 200;
+        Serial.add_input("GET\n");
+        EXPECT_TRUE(hc.get_next_command()); // LED's handler is done, GET is here
+
+        fake_now = 1200;
+        EXPECT_FALSE(hc.get_next_command());
+
+        const uint32_t* h = hc.get_histogram(0, hc_latency_name);
+
+        ASSERT_NE(h, nullptr);
+        EXPECT_EQ(h[3], 1u); // 5 ticks
+        EXPECT_EQ(hc.get_histogram(0, hc_latency_params)[4], 1u); // 10 ticks
+        EXPECT_EQ(hc.get_histogram(0, hc_latency_done)[7], 1u); // 100 ticks
+        EXPECT_EQ(hc.get_histogram(1, hc_latency_name)[0], 1u);
+        EXPECT_EQ(hc.get_histogram(1, hc_latency_params)[0], 1u); // no parameters
+        EXPECT_EQ(hc.get_histogram(1, hc_latency_done)[10], 1u); // 1000 ticks
+
+        // very long one goes into the last bucket. the clock's overflow is fine
+        fake_now = ULONG_MAX - 10;
+        Serial.add_input("GET\n");
+        EXPECT_TRUE(hc.get_next_command());
+        fake_now = 1ul << 30;
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(hc.get_histogram(1, hc_latency_done)[hc_latency_buckets - 1], 1u);
+
+        // invalid lines and batched commands are not counted until they are reported
+        uint8_t batch[64];
+
+        hc.set_batch_buffer(batch, sizeof(batch));
+        fake_now = 2000;
+        Serial.add_input("BOGUS 1\nBEGIN\nGET\n");
+
+        while (Serial.available() > 0)
+            EXPECT_FALSE(hc.get_next_command());
+
+        fake_now = 2050;
+        Serial.add_input("COMMIT\n");
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(hc.get_histogram(1, hc_latency_name)[0], 3u); // timed from the moment of replay
+
+        uint32_t total = 0;
+
+        for (int i = 0; i < hc_latency_buckets; ++i)
+            total += hc.get_histogram(1, hc_latency_name)[i] + hc.get_histogram(0, hc_latency_name)[i];
+
+        EXPECT_EQ(total, 4u);
+
+        fake_step = 1;
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Trace)
+    {
+        host_command hc(32, &Serial);
+        uint8_t store[hc_trace_header + 16 * hc_trace_event];
+
+        EXPECT_EQ(hc.new_command("LED", "d b"), 2);
+        EXPECT_FALSE(hc.set_trace(store, hc_trace_header + hc_trace_event - 1));
+        EXPECT_TRUE(hc.set_trace(store, sizeof(store)));
+
+        fake_step = 0;
+        fake_now = 0x12345678;
+        hc.set_clock(fake_clock, 1);
+        Serial.add_input("LED 3 on\nBOGUS 1\n");
+
+        while (Serial.available() > 0)
+            if (hc.get_next_command())
+                while (hc.has_next_parameter())
+                    ;
+
+        // kind, command, parameter, arg
+        const uint8_t expected[][4] =
+        {
+            { hc_trace_start, 0xFF, 0xFF, 'L' },
+            { hc_trace_command, 0, 0xFF, 0 },
+            { hc_trace_param, 0, 0, 0 },
+            { hc_trace_param, 0, 1, 0 },
+            { hc_trace_reset, 0, 1, 0 },
+            { hc_trace_start, 0xFF, 0xFF, 'B' },
+            { hc_trace_reset, 0xFF, 0xFF, 1 }, // skipping till EOL
+            { hc_trace_error, 0xFF, 0xFF, 13 },
+            { hc_trace_reset, 0xFF, 0xFF, 0 },
+        };
+        int count = store[8] | (store[9] << 8);
+
+        EXPECT_EQ(memcmp(store, "HCT1", 4), 0);
+        ASSERT_EQ(count, 9);
+
+        for (int i = 0; i < count; ++i)
+        {
+            const uint8_t* e = store + hc_trace_header + i * hc_trace_event;
+
+            EXPECT_EQ(e[0] | (e[1] << 8) | (e[2] << 16) | ((uint32_t)e[3] << 24), 0x12345678u);
+            EXPECT_EQ(memcmp(e + 4, expected[i], 4), 0) << "event " << i << ": " << (int)e[4] << " " << (int)e[5] << " " << (int)e[6] << " " << (int)e[7];
+        }
+
+        // the dump is oldest first
+        Serial.output.clear();
+        hc.dump_trace(&Serial);
+        EXPECT_EQ(Serial.output.substr(0, 42), "TRACE 9\n78563412" "01FFFF4C\n78563412" "0200FF00\n");
+
+        // kept over the reset, if the storage is the same
+        host_command again(32, &Serial);
+
+        EXPECT_TRUE(again.set_trace(store, sizeof(store)));
+        Serial.add_input("X\n");
+        EXPECT_FALSE(again.get_next_command());
+        EXPECT_GT(store[8] | (store[9] << 8), count);
+
+        // the oldest are overwritten
+        for (int i = 0; i < 20; ++i)
+            Serial.add_input("LED 1 1\n");
+
+        while (Serial.available() > 0)
+            if (hc.get_next_command())
+                while (hc.has_next_parameter())
+                    ;
+
+        EXPECT_EQ(store[8] | (store[9] << 8), 16);
+
+        Serial.output.clear();
+        hc.dump_trace(&Serial);
+        EXPECT_EQ(Serial.output.substr(0, 9), "TRACE 16\n");
+        EXPECT_EQ(Serial.output.substr(Serial.output.length() - 4), "END\n");
+
+        // other size: started anew
+        EXPECT_TRUE(hc.set_trace(store, sizeof(store) - hc_trace_event));
+        EXPECT_EQ(store[8] | (store[9] << 8), 0);
+
+        fake_step = 1;
+    }
+
+    //======================================================
+    static int flow_calls;
+    static bool flow_stop;
+
+    static void flow_hook(host_command*, bool stop)
+    {
+        ++flow_calls;
+        flow_stop = stop;
+    }
+
+    TEST_F(host_commandTest, test_Flow_Control)
+    {
+        host_command hc(32, &Serial);
+        std::string input;
+
+        EXPECT_EQ(hc.new_command("GET", ""), 0);
+
+        for (int i = 0; i < 30; ++i)
+            input += "GET\n";
+
+        // XON/XOFF
+        hc.set_flow_control(20, 5);
+        Serial.add_input(input);
+        Serial.output.clear();
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.is_input_paused());
+        EXPECT_EQ(Serial.output, "\x13");
+
+        int got = 1;
+
+        while (hc.is_input_paused())
+        {
+            EXPECT_TRUE(hc.get_next_command());
+            ++got;
+        }
+
+        EXPECT_EQ(Serial.output, "\x13\x11");
+        EXPECT_LE(Serial.available(), 5);
+        EXPECT_EQ(got, 30); // resumed with 4 bytes of the last one waiting
+
+        while (hc.get_next_command())
+            ++got;
+
+        EXPECT_EQ(got, 30);
+        EXPECT_EQ(Serial.output, "\x13\x11"); // nothing more
+
+        host_command_stats st = hc.get_stats();
+
+        EXPECT_EQ(st.depth_max, input.length());
+        EXPECT_EQ(st.flow_stops, 1u);
+
+        // hook, e.g. RTS line
+        flow_calls = 0;
+        hc.set_flow_control(8, 0, flow_hook);
+        Serial.add_input("GET\nGET\nGET\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(flow_calls, 1);
+        EXPECT_TRUE(flow_stop);
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_EQ(flow_calls, 1);
+        EXPECT_FALSE(hc.get_next_command()); // all is read now
+        EXPECT_EQ(flow_calls, 2);
+        EXPECT_FALSE(flow_stop);
+
+        // turned off while stopped: the sender is resumed
+        Serial.add_input(input);
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(flow_stop);
+        hc.set_flow_control(0, 0);
+        EXPECT_FALSE(flow_stop);
+        EXPECT_FALSE(hc.is_input_paused());
+        EXPECT_EQ(flow_calls, 4);
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Rate_Limit)
+    {
+        host_command hc(32, &Serial);
+
+        fake_step = 0;
+        fake_now = ULONG_MAX - 100; // the clock wraps around in the middle
+        hc.set_clock(fake_clock, 1);
+
+        EXPECT_EQ(hc.new_command("FLASH", "d"), 1);
+        hc.set_rate_limit(2, 1000); // a token per 500 ticks
+        EXPECT_EQ(hc.new_command("GET", ""), 0);
+
+        Serial.add_input("FLASH 1\nFLASH 2\nFLASH 3\nGET\n");
+
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 1);
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 2);
+
+        EXPECT_FALSE(hc.get_next_command()); // the handler is not called
+        EXPECT_TRUE(hc.is_invalid_input());
+        EXPECT_STREQ(hc.errstr(), "command rate limit exceeded");
+        EXPECT_EQ(hc.get_command_id(), -1);
+
+        EXPECT_TRUE(hc.get_next_command()); // its parameter is skipped
+        EXPECT_STREQ(hc.get_command_name(), "GET");
+        EXPECT_EQ(hc.get_rejected(0), 1u);
+        EXPECT_EQ(hc.get_rejected(1), 0u);
+        EXPECT_EQ(hc.get_rejected(-1), 1u);
+        EXPECT_EQ(hc.get_rejected(2), 0u);
+
+        // a token is back
+        fake_now += 499;
+        Serial.add_input("FLASH 4;FLASH 5\n");
+        EXPECT_FALSE(hc.get_next_command());
+        fake_now += 1;
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 5);
+        EXPECT_EQ(hc.get_rejected(0), 2u);
+
+        // all the commands. the bucket starts full
+        fake_now += 10000;
+        hc.limit_rate(3, 300);
+        Serial.add_input("GET\nGET\nGET\nGET\nFLASH 6\n");
+
+        for (int i = 0; i < 3; ++i)
+            EXPECT_TRUE(hc.get_next_command());
+
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(hc.get_rejected(1), 1u);
+        EXPECT_FALSE(hc.get_next_command());
+        EXPECT_EQ(hc.get_rejected(0), 3u); // FLASH has tokens, but the instance has none
+        EXPECT_EQ(hc.get_rejected(-1), 4u);
+
+        fake_now += 100;
+        Serial.add_input("FLASH 7\n");
+        EXPECT_TRUE(hc.get_next_command());
+        EXPECT_TRUE(hc.has_next_parameter());
+        EXPECT_EQ(hc.get_int(), 7);
+
+#if defined(HOST_CMD_STATS)
+        EXPECT_EQ(hc.get_stats().errors[15], 4u);
+#endif
+
+        // no limits
+        hc.limit_rate(0, 0);
+        Serial.add_input("GET\nGET\nGET\nGET\nGET\n");
+
+        for (int i = 0; i < 5; ++i)
+            EXPECT_TRUE(hc.get_next_command());
+
+        // the batch takes effect together: all of its commands are within the limits or none is run
+        uint8_t storage[64];
+
+        fake_now += 10000; // FLASH has 2 tokens
+        hc.set_batch_buffer(storage, sizeof(storage));
+        Serial.add_input("BEGIN\nFLASH 8\nFLASH 9\nFLASH 10\nCOMMIT\n");
+
+        while (Serial.available() > 0)
+            EXPECT_FALSE(hc.get_next_command());
+
+        EXPECT_TRUE(hc.is_invalid_input());
+        EXPECT_STREQ(hc.errstr(), "command rate limit exceeded");
+        EXPECT_EQ(hc.get_rejected(0), 6u);
+
+        Serial.add_input("BEGIN\nFLASH 11\nGET\nFLASH 12\nCOMMIT\nFLASH 13\n");
+        EXPECT_FALSE(hc.get_next_command()); // BEGIN
+
+        int values[] = { 11, -1, 12 };
+
+        for (int i = 0; i < 3; ++i)
+        {
+            EXPECT_TRUE(hc.get_next_command());
+
+            if (values[i] < 0)
+            {
+                EXPECT_STREQ(hc.get_command_name(), "GET");
+            }
+            else
+            {
+                EXPECT_TRUE(hc.has_next_parameter());
+                EXPECT_EQ(hc.get_int(), values[i]);
+            }
+        }
+
+        EXPECT_FALSE(hc.get_next_command()); // the batch has taken the tokens
+        EXPECT_EQ(hc.get_rejected(0), 7u);
+
+        fake_step = 1;
+    }
+
+    //======================================================
+    TEST_F(host_commandTest, test_Multiplexer)
+    {
+        test_Stream uart1, uart2;
+        host_command usb(32, &Serial);
+        host_command hc1(32, &uart1);
+        host_command hc2(16, &uart2);
+
+        EXPECT_EQ(usb.new_command("LED", "d b"), 2);
+        EXPECT_EQ(usb.new_command("GET", ""), 0);
+
+        EXPECT_TRUE(hc1.share_commands(usb));
+        EXPECT_TRUE(hc2.share_commands(usb));
+        EXPECT_FALSE(hc2.share_commands(usb)); // already
+        EXPECT_FALSE(usb.share_commands(hc1)); // has own ones
+
+        size_t calls = alloc_calls;
+
+        EXPECT_EQ(hc1.new_command("SET", "d"), -1);
+        EXPECT_STREQ(hc1.errstr(), "commands are shared from another instance");
+        EXPECT_EQ(alloc_calls, calls);
+
+        // the definitions are the very same
+        uart1.add_input("LED 2 on\n");
+        EXPECT_TRUE(hc1.get_next_command());
+        EXPECT_EQ(hc1.get_command_id(), 0);
+        EXPECT_TRUE(hc1.has_next_parameter());
+        EXPECT_TRUE(hc1.has_next_parameter());
+        EXPECT_TRUE(hc1.get_bool());
+
+        Serial.add_input("LED 0 off\n");
+        EXPECT_TRUE(usb.get_next_command());
+        EXPECT_EQ(usb.get_command_name(), hc1.get_command_name());
+
+        while (usb.has_next_parameter())
+            ;
+
+        // fair turns
+        host_command* all[] = { &usb, &hc1, &hc2 };
+        host_command_mux mux(all, 3, 8);
+        std::string order;
+
+        Serial.add_input("GET\nGET\nGET\n");
+        uart1.add_input("LED 1 on\nLED 2 off\n");
+        uart2.add_input("GET\n");
+
+        for (host_command* hc; (hc = mux.get_next_command()) != nullptr; )
+        {
+            order += static_cast<char>('0' + mux.get_index());
+
+            while (hc->has_next_parameter())
+                ;
+        }
+
+        EXPECT_EQ(order, "012010");
+        EXPECT_EQ(mux.get_index(), -1);
+
+        // long line on one source does not hold the others
+        uart1.add_input(std::string(40, ' ') + "LED 3 on\n");
+        Serial.add_input("GET\n");
+
+        EXPECT_EQ(mux.get_next_command(), &usb); // 8 spaces of uart1 are skipped before
+        EXPECT_EQ(mux.get_next_command(), nullptr);
+        EXPECT_GT(uart1.available(), 0);
+
+        host_command* hc;
+
+        while ((hc = mux.get_next_command()) == nullptr)
+            ;
+
+        EXPECT_EQ(hc, &hc1);
+        EXPECT_STREQ(hc->get_command_name(), "LED");
+        EXPECT_FALSE(mux.is_continued());
+
+        while (hc->has_next_parameter())
+            ;
+
+        // the budget splits the command: it is continued, not reported again
+        uart1.add_input("LED     12345 on\nGET\n");
+
+        int reported = 0, continued = 0, got = 0;
+        int value = 0;
+        bool on = false;
+
+        for (int i = 0; i < 20; ++i)
+        {
+            if ((hc = mux.get_next_command()) == nullptr)
+                continue;
+
+            EXPECT_EQ(hc, &hc1);
+
+            if (hc->get_command_id() == 1)
+                break;
+
+            EXPECT_EQ(hc->get_command_id(), 0);
+
+            if (mux.is_continued())
+                ++continued;
+            else
+                ++reported;
+
+            while (hc->has_next_parameter())
+            {
+                if (hc->get_parameter_index() == 0)
+                    value = hc->get_int();
+                else
+                    on = hc->get_bool();
+
+                ++got;
+            }
+        }
+
+        EXPECT_EQ(reported, 1);
+        EXPECT_GT(continued, 0);
+        EXPECT_EQ(got, 2);
+        EXPECT_EQ(value, 12345);
+        EXPECT_TRUE(on);
+        EXPECT_EQ(hc->get_command_id(), 1);
+        EXPECT_FALSE(hc->is_invalid_input());
+    }
 };
 
 //===================================================================
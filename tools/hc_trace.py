@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""Decoder of host_command's trace ring.
+
+Reads the output of host_command::dump_trace() (TRACE ... END block, the other lines are skipped)
+or, with --raw, the binary image of the trace storage itself, e.g. dumped by the debugger from RAM surviving reset.
+
+Usage:
+    hc_trace.py [--raw] [--commands LED,GET,...] [--ticks-per-ms 1000] [file]
+
+The repo is in github.com/kadavris
+"""
+
+import argparse
+import struct
+import sys
+
+HEADER = 12  # "HCT1", capacity, next event's index, number of events
+EVENT = 8    # time, kind, command's ID, parameter's index, arg
+
+KINDS = {
+    1: "start",
+    2: "command",
+    3: "param",
+    4: "error",
+    5: "reset",
+    6: "timeout",
+}
+
+# the same as hc_errors[] in src/host_command.cpp
+ERRORS = [
+    "no error",
+    "bad parameter's length in definiton",
+    "bad char on parameter's definition",
+    "attempt to define duplicate command name",
+    "required parameter missing",
+    "invalid parameters specification for new_command(Source, SPEC)",
+    "parameter length exceeded or user requested too small buffer",
+    "expected quoted string but got no quote",
+    "invalid hex or base64 encoded data",
+    "timed out",
+    "invalid length prefix of raw data",
+    "malformed binary frame",
+    "missing or wrong checksum",
+    "unknown command",
+    "batch has invalid commands or does not fit",
+    "command rate limit exceeded",
+    "commands are shared from another instance",
+    "too many commands for one byte index",
+]
+
+
+def events_from_text(text):
+    """Return the list of raw events of the last TRACE block."""
+    events = None
+    result = None
+
+    for line in text.splitlines():
+        line = line.strip()
+
+        if line.startswith("TRACE "):
+            events = []
+        elif line == "END":
+            if events is not None:
+                result = events
+        elif events is not None and len(line) == 2 * EVENT:
+            events.append(bytes.fromhex(line))
+
+    if result is None:
+        sys.exit("no complete TRACE ... END block found")
+
+    return result
+
+
+def events_from_raw(data):
+    """Return the list of raw events from the storage image, the oldest first."""
+    if len(data) < HEADER or data[:4] != b"HCT1":
+        sys.exit("not a trace storage image")
+
+    cap, pos, count = struct.unpack_from("<HHH", data, 4)
+
+    if pos >= cap or count > cap or len(data) < HEADER + cap * EVENT:
+        sys.exit("broken trace storage header")
+
+    if count < cap:
+        pos = 0
+
+    events = []
+
+    for _ in range(count):
+        events.append(data[HEADER + pos * EVENT:HEADER + (pos + 1) * EVENT])
+        pos = (pos + 1) % cap
+
+    return events
+
+
+def describe(ev, names):
+    """Return the event's text, less the time."""
+    time, kind, cmd, param, arg = struct.unpack("<IBBBB", ev)
+    text = KINDS.get(kind, "kind%d" % kind)
+
+    if cmd != 0xFF:
+        name = names[cmd] if cmd < len(names) else "#%d" % cmd
+        text += " cmd=" + name
+
+        if param != 0xFF:
+            text += " param=%d" % param
+
+    if kind == 1:
+        text += " byte=%r" % chr(arg)
+    elif kind == 4:
+        text += " %d: %s" % (arg, ERRORS[arg] if arg < len(ERRORS) else "?")
+    elif kind == 5 and arg:
+        text += " skipping invalid input"
+
+    return time, text
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Decode host_command's trace ring")
+    ap.add_argument("file", nargs="?", help="dump_trace() output or storage image. stdin if none")
+    ap.add_argument("--raw", action="store_true", help="the file is the binary image of trace storage")
+    ap.add_argument("--commands", default="", help="comma-separated command names in the order of their IDs")
+    ap.add_argument("--ticks-per-ms", type=float, default=1000, help="clock ticks per millisecond. 1000 for micros()")
+    args = ap.parse_args()
+
+    if args.raw:
+        data = open(args.file, "rb").read() if args.file else sys.stdin.buffer.read()
+        events = events_from_raw(data)
+    else:
+        text = open(args.file, errors="replace").read() if args.file else sys.stdin.read()
+        events = events_from_text(text)
+
+    names = [n for n in args.commands.split(",") if n]
+    first = None
+
+    for ev in events:
+        time, text = describe(ev, names)
+
+        if first is None:
+            first = time
+
+        ms = ((time - first) & 0xFFFFFFFF) / args.ticks_per_ms  # the clock wraps around
+        print("%12.3f ms  %s" % (ms, text))
+
+
+if __name__ == "__main__":
+    main()